@@ -0,0 +1,90 @@
+// The xv6 system calls ummalloc_test and the allocators make, for the
+// native build of ummalloc_test (make host). The rest of user.h comes from
+// user/ulib.c, user/printf.c and libc.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+// unistd.h would declare sbrk, read and write with libc's types
+long syscall(long number, ...);
+
+typedef unsigned long uint64;
+
+// what the guest's user memory is bounded by: qemu runs with -m 128M
+#define ARENA (128 * 1024 * 1024)
+// xv6 user addresses are small, and allocators may keep pointers in 32 bits
+#define ARENA_BASE 0x40000000UL
+#define PGSIZE 4096
+#define PGROUNDUP(a) (((a) + PGSIZE - 1) & ~(uint64)(PGSIZE - 1))
+
+static char *arena;
+static uint64 brk;  // offset of the break in the arena
+
+/*
+ * sbrk - grow or shrink the heap by n bytes in a private arena, as
+ *     growproc does: pages come zeroed, and the pages that a shrink gives
+ *     back come zeroed if they are grown into again.
+ */
+char *
+sbrk(int n)
+{
+  if(arena == 0){
+    arena = mmap((void *)ARENA_BASE, ARENA, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if(arena == MAP_FAILED){
+      perror("sbrk: mmap");
+      exit(2);
+    }
+  }
+  uint64 old = brk;
+  if((n < 0 && -(long)n > old) || old + n > ARENA)
+    return (char *)-1;
+  brk = old + n;
+  if(n < 0 && PGROUNDUP(brk) < PGROUNDUP(old))
+    madvise(arena + PGROUNDUP(brk), PGROUNDUP(old) - PGROUNDUP(brk), MADV_DONTNEED);
+  return arena + old;
+}
+
+// qemu's mtime runs at 10 MHz, so a tick is 100 ns here too
+uint64
+getclk(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+}
+
+// the flags of kernel/fcntl.h, which can't be included next to libc's
+#define XV6_O_CREATE 0x200
+#define XV6_O_TRUNC 0x400
+
+int
+open(const char *path, int omode, ...)
+{
+  int flags = omode & O_ACCMODE;
+
+  if(omode & XV6_O_CREATE)
+    flags |= O_CREAT;
+  if(omode & XV6_O_TRUNC)
+    flags |= O_TRUNC;
+  return syscall(SYS_openat, AT_FDCWD, path, flags, 0644);
+}
+
+// xv6 counts are ints, libc's are size_t
+int
+read(int fd, void *p, int n)
+{
+  return syscall(SYS_read, fd, p, (long)n);
+}
+
+int
+write(int fd, const void *p, int n)
+{
+  return syscall(SYS_write, fd, p, (long)n);
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel/types.h"
+#include "user/trace.h"
+
+// Convert a .rep trace to the .bin form of user/trace.h, for fs.img.
+// usage: rep2bin in.rep out.bin
+
+char *repname;
+
+void
+die(const char *s)
+{
+  fprintf(stderr, "rep2bin: %s: %s\n", repname, s);
+  exit(1);
+}
+
+uint
+getnum(FILE *f)
+{
+  uint x;
+
+  if(fscanf(f, "%u", &x) != 1)
+    die("bad number");
+  return x;
+}
+
+int
+main(int argc, char *argv[])
+{
+  FILE *in, *out;
+  struct trace_hdr hdr;
+  struct trace_rec *recs, *r;
+  uint id, size, arg, n, i;
+  char op;
+
+  if(argc != 3){
+    fprintf(stderr, "Usage: rep2bin in.rep out.bin\n");
+    exit(1);
+  }
+  repname = argv[1];
+  if((in = fopen(argv[1], "r")) == 0){
+    perror(argv[1]);
+    exit(1);
+  }
+
+  hdr.magic = TRACE_MAGIC;
+  hdr.num_ids = getnum(in);
+  hdr.num_ops = getnum(in);
+  hdr.flags = 0;
+  if(hdr.num_ids > REC_MAX_ID + 1)
+    die("too many ids");
+  recs = calloc(hdr.num_ops ? hdr.num_ops : 1, sizeof(*recs));
+  if(recs == 0)
+    die("out of memory");
+
+  for(i = 0; i < hdr.num_ops; i++){
+    r = recs + i;
+    if(fscanf(in, " %c", &op) != 1)
+      die("trace ends early");
+    id = getnum(in);
+    size = arg = 0;
+    n = 1;
+    switch(op){
+    case 'a':
+      r->head = REC_PACK(ALLOC, 0, id);
+      size = getnum(in);
+      break;
+    case 'f':
+      r->head = REC_PACK(FREE, 0, id);
+      break;
+    case 'r':
+      r->head = REC_PACK(REALLOC, 0, id);
+      size = getnum(in);
+      break;
+    case 'A':
+      size = getnum(in);
+      n = arg = getnum(in);
+      if(arg > REC_MAX_ARG)
+        die("batch too big");
+      r->head = REC_PACK(BALLOC, arg, id);
+      break;
+    case 'F':
+      n = arg = getnum(in);
+      if(arg > REC_MAX_ARG)
+        die("batch too big");
+      r->head = REC_PACK(BFREE, arg, id);
+      break;
+    case 'm':
+      n = getnum(in);
+      size = getnum(in);
+      if(n == 0 || (n & (n - 1)) != 0)
+        die("align not a power of two");
+      while((1u << arg) < n)
+        arg++;
+      r->head = REC_PACK(MEMALIGN, arg, id);
+      hdr.flags |= TRACE_MEMALIGN;
+      n = 1;
+      break;
+    case 's':
+      r->head = REC_PACK(FREE_SIZED, 0, id);
+      size = getnum(in);
+      break;
+    case 'c':
+      arg = getnum(in);
+      size = getnum(in);
+      if(arg > REC_MAX_ARG)
+        die("calloc too big");
+      r->head = REC_PACK(CALLOC, arg, id);
+      break;
+    default:
+      die("bad op");
+    }
+    if(id + n > hdr.num_ids)
+      die("id out of range");
+    r->size = size;
+  }
+  fclose(in);
+
+  if((out = fopen(argv[2], "w")) == 0){
+    perror(argv[2]);
+    exit(1);
+  }
+  if(fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+     fwrite(recs, sizeof(*recs), hdr.num_ops, out) != hdr.num_ops ||
+     fclose(out) != 0){
+    perror(argv[2]);
+    exit(1);
+  }
+  free(recs);
+  return 0;
+}
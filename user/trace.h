@@ -0,0 +1,37 @@
+// Allocation traces, as ummalloc_test replays them.
+//
+// A .rep trace is text: "num_ids num_ops" and then one op per line,
+//   a id size / f id / r id size / A id size n / F id n / m id align size /
+//   s id size, a free that passes the size id was last given /
+//   c id n size, zeroed memory for n objects of size bytes.
+// A .bin trace, made from it on the host by mkfs/rep2bin, is a struct
+// trace_hdr followed by num_ops struct trace_rec, so that it reads in big
+// chunks and needs no parsing.
+
+typedef enum { ALLOC, FREE, REALLOC, BALLOC, BFREE, MEMALIGN, FREE_SIZED, CALLOC } op_t;
+
+#define TRACE_MAGIC 0x52544d4d  // "MMTR"
+#define TRACE_MEMALIGN 0x1      // any m op in it
+
+struct trace_hdr {
+  uint magic;
+  uint num_ids;
+  uint num_ops;
+  uint flags;
+};
+
+// head packs op, arg and id: arg is n for A, F and c, log2 of align for m.
+// size is 0 for f and F. op has 3 bits, and all eight ops are taken.
+struct trace_rec {
+  uint head;
+  uint size;
+};
+
+#define REC_ID_BITS 21
+#define REC_MAX_ID ((1 << REC_ID_BITS) - 1)
+#define REC_MAX_ARG 0xff
+
+#define REC_PACK(op, arg, id) (((uint)(op) << 29) | ((uint)(arg) << REC_ID_BITS) | (uint)(id))
+#define REC_OP(head) ((op_t)((head) >> 29))
+#define REC_ARG(head) (((head) >> REC_ID_BITS) & REC_MAX_ARG)
+#define REC_ID(head) ((head) & REC_MAX_ID)
@@ -0,0 +1,541 @@
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Generate a synthetic .rep trace for ummalloc_test from a seed and
+// a few distributions. Builds as an xv6 program and, with make host, as
+// host/tracegen.
+//
+// usage: tracegen [-n ops] [-s seed] [-z sizes] [-t lifetimes]
+//                 [-g pct:growth] [-L live] out.rep|-
+//
+//   -n  about this many ops (20000); blocks still live at the end are freed
+//   -s  seed (1); the same options and seed give the same trace
+//   -z  block sizes, one of
+//         uniform:lo:hi
+//         lognormal:median:sigma   sigma of the natural log, e.g. 1.5
+//         bimodal:a:b:pct          size a pct% of the time, else b
+//         hist:size=w,size=w,...   sizes drawn in proportion to w
+//       (lognormal:64:1.0)
+//   -t  lifetimes, in ops: exp:mean, uniform:lo:hi or bimodal:a:b:pct
+//       (exp:1000)
+//   -g  pct% of blocks are buffers that grow by reallocs over their
+//       lifetime, xN meaning by N% each time, +N by N bytes (0:x150)
+//   -L  no new block while this many bytes are live: the block due
+//       soonest dies early instead, as does a buffer whose growth would
+//       go past it (1048576)
+//
+// Time is counted in ops. A block is freed, or reallocated, when its time
+// comes; ids of freed blocks are handed out again. No floating point:
+// user programs here don't get the FPU, so logs and powers are fixed-point
+// with 16 fraction bits.
+
+#define FRAC 16
+#define ONE (1 << FRAC)
+#define MAX_SIZE (1 << 24)
+#define MAX_LIFE (1 << 30)
+#define MAX_STEPS 8     // most reallocs of a growing buffer
+#define MAX_BINS 32     // sizes in a hist: distribution
+
+enum { UNIFORM, LOGNORMAL, BIMODAL, HIST, EXP };
+
+struct dist {
+  int kind;
+  int a, b;
+  int pct;              // bimodal: how often a
+  int sigma;            // lognormal: sigma in thousandths
+  int nbins;            // hist:
+  int bin_size[MAX_BINS];
+  int bin_weight[MAX_BINS];
+  int total_weight;
+};
+
+struct block {
+  int id;
+  uint size;
+  uint born;
+  uint life;
+  int steps;            // reallocs it gets before the free
+  int step;             // reallocs so far
+  uint due;             // time of its next event
+  int pos;              // where it is in heap
+};
+
+int nops = 20000;
+uint64 seed = 1;
+struct dist sizes = { LOGNORMAL, 64, 0, 0, 1000 };
+struct dist lifetimes = { EXP, 1000 };
+int grow_pct;
+int grow_mul = 150;     // percent per realloc, or 0
+int grow_add;           // bytes per realloc, if grow_mul is 0
+uint live_target = 1 << 20;
+
+uint64 rng;
+struct block *blocks;   // one per live block
+int nblocks, cap_blocks;
+int *heap;              // indices into blocks, by due time
+int *free_ids;
+int nfree_ids, next_id;
+
+// output is buffered here, as printf is a write per character
+char obuf[4096];
+int olen;
+int ofd = -1;           // -1 on the counting pass
+uint emitted;
+
+void
+usage(void)
+{
+  fprintf(2, "usage: tracegen [-n ops] [-s seed] [-z sizes] [-t lifetimes] "
+             "[-g pct:growth] [-L live] out.rep|-\n");
+  exit(1);
+}
+
+void
+die(char *msg, char *arg)
+{
+  fprintf(2, "tracegen: %s: %s\n", msg, arg);
+  exit(1);
+}
+
+// xorshift64*
+uint
+rand32(void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (rng * 2685821657736338717ULL) >> 32;
+}
+
+// uniform in [lo, hi]
+uint
+rand_range(uint lo, uint hi)
+{
+  return lo + rand32() % (hi - lo + 1);
+}
+
+// 2^(x / ONE), for x in fixed point, times ONE
+uint64
+pow2_fx(long x)
+{
+  long i = x >> FRAC;
+  uint64 f = x & (ONE - 1);
+  // 2^f ~ 1 + f (0.6565 + 0.3435 f) on [0, 1)
+  uint64 m = ONE + ((f * (43024 + ((22512 * f) >> FRAC))) >> FRAC);
+  if(i >= 0)
+    return i > 40 ? (uint64)1 << 56 : m << i;
+  return i < -40 ? 0 : m >> -i;
+}
+
+// log2(x) in fixed point, for x >= 1
+long
+log2_fx(uint x)
+{
+  long k = 31;
+  while(!(x >> k))
+    k--;
+  // the mantissa as 1 + f, f in [0, 1), and log2(1 + f) ~ f (1.3466 - 0.3466 f)
+  uint64 f = ((uint64)x << FRAC >> k) - ONE;
+  return (k << FRAC) + ((f * (88254 - ((22714 * f) >> FRAC))) >> FRAC);
+}
+
+// ~N(0, 1) in fixed point, as the sum of 12 uniforms less 6
+long
+normal_fx(void)
+{
+  long z = 0;
+  for(int i = 0; i < 12; i++)
+    z += rand32() >> (32 - FRAC);
+  return z - 6 * ONE;
+}
+
+uint64
+draw(struct dist *d)
+{
+  int w;
+
+  switch(d->kind){
+  case UNIFORM:
+    return rand_range(d->a, d->b);
+  case LOGNORMAL:
+    // median * 2^(sigma z / ln 2); 1/ln 2 = 1.4427
+    return d->a * pow2_fx((long)d->sigma * 1443 / 1000 * normal_fx() / 1000) >> FRAC;
+  case BIMODAL:
+    return rand32() % 100 < d->pct ? d->a : d->b;
+  case HIST:
+    w = rand32() % d->total_weight;
+    for(int i = 0; ; i++){
+      if(w < d->bin_weight[i])
+        return d->bin_size[i];
+      w -= d->bin_weight[i];
+    }
+  case EXP:
+    // -mean ln(u) = mean ln 2 (32 - log2(r)), for u = r / 2^32
+    return ((uint64)d->a * (((long)32 << FRAC) - log2_fx(rand32() | 1)) * 45426 >> FRAC) >> FRAC;
+  }
+  return 0;
+}
+
+uint
+draw_size(void)
+{
+  uint64 x = draw(&sizes);
+  if(x < 1)
+    return 1;
+  return x > MAX_SIZE ? MAX_SIZE : x;
+}
+
+// a fixed-point decimal like "1.5", in thousandths
+int
+atofx(char *s)
+{
+  int x = 0, scale = 1000;
+
+  for(; *s >= '0' && *s <= '9'; s++)
+    x = x * 10 + *s - '0';
+  x *= 1000;
+  if(*s == '.')
+    for(s++; *s >= '0' && *s <= '9' && scale > 1; s++){
+      scale /= 10;
+      x += (*s - '0') * scale;
+    }
+  return x;
+}
+
+// the next field of a spec, after a ':'
+char*
+field(char *s, char *spec)
+{
+  s = strchr(s, ':');
+  if(s == 0)
+    die("missing field", spec);
+  return s + 1;
+}
+
+void
+parse_dist(char *spec, struct dist *d)
+{
+  char *s;
+
+  memset(d, 0, sizeof(*d));
+  if(memcmp(spec, "uniform:", 8) == 0){
+    d->kind = UNIFORM;
+    s = field(spec, spec);
+    d->a = atoi(s);
+    d->b = atoi(field(s, spec));
+    if(d->a > d->b)
+      die("lo above hi", spec);
+  } else if(memcmp(spec, "lognormal:", 10) == 0){
+    d->kind = LOGNORMAL;
+    s = field(spec, spec);
+    d->a = atoi(s);
+    d->sigma = atofx(field(s, spec));
+  } else if(memcmp(spec, "bimodal:", 8) == 0){
+    d->kind = BIMODAL;
+    s = field(spec, spec);
+    d->a = atoi(s);
+    s = field(s, spec);
+    d->b = atoi(s);
+    d->pct = atoi(field(s, spec));
+  } else if(memcmp(spec, "exp:", 4) == 0){
+    d->kind = EXP;
+    d->a = atoi(field(spec, spec));
+  } else if(memcmp(spec, "hist:", 5) == 0){
+    d->kind = HIST;
+    for(s = spec + 5; *s; ){
+      if(d->nbins == MAX_BINS)
+        die("too many sizes", spec);
+      d->bin_size[d->nbins] = atoi(s);
+      s = strchr(s, '=');
+      if(s == 0)
+        die("size without weight", spec);
+      d->bin_weight[d->nbins] = atoi(++s);
+      d->total_weight += d->bin_weight[d->nbins++];
+      s = strchr(s, ',');
+      if(s == 0)
+        break;
+      s++;
+    }
+    if(d->total_weight <= 0)
+      die("no weight", spec);
+  } else {
+    die("unknown distribution", spec);
+  }
+}
+
+void
+flush(void)
+{
+  if(ofd >= 0 && olen > 0 && write(ofd, obuf, olen) != olen){
+    fprintf(2, "tracegen: write error\n");
+    exit(1);
+  }
+  olen = 0;
+}
+
+void
+putch(char c)
+{
+  if(olen == sizeof(obuf))
+    flush();
+  obuf[olen++] = c;
+}
+
+void
+putnum(uint x)
+{
+  char buf[10];
+  int n = 0;
+
+  do {
+    buf[n++] = '0' + x % 10;
+  } while((x /= 10) != 0);
+  while(n > 0)
+    putch(buf[--n]);
+}
+
+// one op of the trace: "c id" or "c id size"
+void
+emit(char c, int id, uint size)
+{
+  emitted++;
+  if(ofd < 0)
+    return;
+  putch(c);
+  putch(' ');
+  putnum(id);
+  if(c != 'f'){
+    putch(' ');
+    putnum(size);
+  }
+  putch('\n');
+}
+
+// the arrays grow as blocks do, by doubling
+void*
+grow(void *old, int n, int size)
+{
+  void *p = malloc(2 * n * size);
+  if(p == 0){
+    fprintf(2, "tracegen: out of memory\n");
+    exit(1);
+  }
+  if(old){
+    memmove(p, old, n * size);
+    free(old);
+  }
+  return p;
+}
+
+int
+before(int i, int j)
+{
+  return blocks[heap[i]].due < blocks[heap[j]].due;
+}
+
+void
+swap(int i, int j)
+{
+  int t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+  blocks[heap[i]].pos = i;
+  blocks[heap[j]].pos = j;
+}
+
+void
+sift_down(int i)
+{
+  for(;;){
+    int c = 2 * i + 1;
+    if(c >= nblocks)
+      return;
+    if(c + 1 < nblocks && before(c + 1, c))
+      c++;
+    if(!before(c, i))
+      return;
+    swap(i, c);
+    i = c;
+  }
+}
+
+void
+sift_up(int i)
+{
+  while(i > 0 && before(i, (i - 1) / 2)){
+    swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+// time of the next event of b: its reallocs spread evenly over its life
+uint
+next_due(struct block *b)
+{
+  return b->born + (uint64)b->life * (b->step + 1) / (b->steps + 1);
+}
+
+// ops still to come for the live blocks
+uint pending;
+
+void
+alloc_block(uint now)
+{
+  struct block *b;
+
+  if(nblocks == cap_blocks){
+    blocks = grow(blocks, cap_blocks, sizeof(struct block));
+    heap = grow(heap, cap_blocks, sizeof(int));
+    free_ids = grow(free_ids, cap_blocks, sizeof(int));
+    cap_blocks *= 2;
+  }
+  b = blocks + nblocks;
+  b->id = nfree_ids > 0 ? free_ids[--nfree_ids] : next_id++;
+  b->size = draw_size();
+  b->born = now;
+  b->life = draw(&lifetimes);
+  b->life = b->life < MAX_LIFE ? b->life + 1 : MAX_LIFE;
+  b->steps = grow_pct && rand32() % 100 < grow_pct ? rand_range(1, MAX_STEPS) : 0;
+  b->step = 0;
+  b->due = next_due(b);
+  b->pos = nblocks;
+  heap[nblocks] = nblocks;
+  nblocks++;
+  sift_up(nblocks - 1);
+  pending += b->steps + 1;
+  emit('a', b->id, b->size);
+}
+
+// the event of the block due soonest: a realloc, or its free. if early,
+// or if growing it would go past the live target, it is freed now,
+// whatever reallocs it had left
+uint
+event(uint live, int early)
+{
+  struct block *b = blocks + heap[0];
+  uint64 size = 0;
+
+  if(b->step < b->steps){
+    size = grow_mul ? (uint64)b->size * grow_mul / 100 : (uint64)b->size + grow_add;
+    if(size > MAX_SIZE)
+      size = MAX_SIZE;
+    if(live + size - b->size > live_target)
+      early = 1;
+  }
+  if(early){
+    pending -= b->steps - b->step;
+    b->steps = b->step;
+  }
+  pending--;
+  if(b->step < b->steps){
+    live += size - b->size;
+    b->size = size;
+    b->step++;
+    b->due = next_due(b);
+    emit('r', b->id, b->size);
+    sift_down(0);
+    return live;
+  }
+  emit('f', b->id, 0);
+  live -= b->size;
+  free_ids[nfree_ids++] = b->id;
+  // the last heap entry takes the root, and the last block the freed slot
+  int slot = heap[0];
+  nblocks--;
+  swap(0, nblocks);
+  sift_down(0);
+  if(slot != nblocks){
+    blocks[slot] = blocks[nblocks];
+    heap[blocks[slot].pos] = slot;
+  }
+  return live;
+}
+
+// make the trace once; returns how many ids it used
+int
+generate(void)
+{
+  uint live = 0, now = 0;
+
+  rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+  nblocks = nfree_ids = next_id = 0;
+  pending = emitted = 0;
+  while(emitted + pending < nops){
+    now = emitted;
+    if(nblocks > 0 && live >= live_target){
+      live = event(live, 1);
+    } else if(nblocks > 0 && blocks[heap[0]].due <= now){
+      live = event(live, 0);
+    } else {
+      alloc_block(now);
+      live += blocks[nblocks - 1].size;
+    }
+  }
+  while(nblocks > 0)
+    live = event(live, 0);
+  return next_id;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, num_ids;
+  char *s;
+
+  for(i = 1; i + 1 < argc && argv[i][0] == '-' && argv[i][1] != 0; i += 2){
+    s = argv[i + 1];
+    switch(argv[i][1]){
+    case 'n':
+      nops = atoi(s);
+      break;
+    case 's':
+      seed = atoi(s);
+      break;
+    case 'z':
+      parse_dist(s, &sizes);
+      break;
+    case 't':
+      parse_dist(s, &lifetimes);
+      break;
+    case 'g':
+      grow_pct = atoi(s);
+      s = field(s, argv[i + 1]);
+      grow_mul = grow_add = 0;
+      if(*s == 'x')
+        grow_mul = atoi(s + 1);
+      else if(*s == '+')
+        grow_add = atoi(s + 1);
+      else
+        die("growth is xN or +N", argv[i + 1]);
+      break;
+    case 'L':
+      live_target = atoi(s);
+      break;
+    default:
+      usage();
+    }
+  }
+  if(i + 1 != argc || nops < 2)
+    usage();
+
+  cap_blocks = 1024;
+  blocks = grow(0, cap_blocks / 2, sizeof(struct block));
+  heap = grow(0, cap_blocks / 2, sizeof(int));
+  free_ids = grow(0, cap_blocks / 2, sizeof(int));
+
+  // xv6 can't seek back to the header, so count first, then write
+  num_ids = generate();
+  if(strcmp(argv[i], "-") == 0)
+    ofd = 1;
+  else if((ofd = open(argv[i], O_CREATE | O_WRONLY | O_TRUNC)) < 0)
+    die("cannot open", argv[i]);
+  putnum(num_ids);
+  putch('\n');
+  putnum(emitted);
+  putch('\n');
+  generate();
+  flush();
+  close(ofd);
+  exit(0);
+}
@@ -145,3 +145,38 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+#ifdef MTRACE
+#undef fork
+#undef exit
+#undef exec
+
+// in umalloc.c, but programs like forktest are linked without it
+void mtrace_flush(void) __attribute__((weak));
+void mtrace_forked(void) __attribute__((weak));
+
+int
+mtrace_fork(void)
+{
+  int pid = fork();
+  if(pid == 0 && mtrace_forked)
+    mtrace_forked();
+  return pid;
+}
+
+int
+mtrace_exit(int status)
+{
+  if(mtrace_flush)
+    mtrace_flush();
+  exit(status);
+}
+
+int
+mtrace_exec(const char *path, char **argv)
+{
+  if(mtrace_flush)
+    mtrace_flush();
+  return exec(path, argv);
+}
+#endif
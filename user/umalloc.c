@@ -1,11 +1,19 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
 #include "user/user.h"
 #include "kernel/param.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
 
+#ifdef MTRACE
+// the allocator is kr_malloc and kr_free; malloc and free, at the end of
+// the file, record each call and hand it on
+#define malloc kr_malloc
+#define free kr_free
+#endif
+
 typedef long Align;
 
 union header {
@@ -88,3 +96,265 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+#ifdef MTRACE
+#undef malloc
+#undef free
+
+/*
+ * make MTRACE=1: record the malloc and free calls of a process as a .rep
+ * trace that ummalloc_test can replay, mtrace.<pid>.rep in the directory
+ * it was in at its first call. the header needs the counts, so the ops
+ * are buffered into an unlinked file and copied behind it when ulib.c's
+ * exit or exec wrapper calls mtrace_flush. a forked child starts a trace
+ * of its own: the blocks it got from its parent are not in it, and frees
+ * of blocks a trace doesn't know are left out.
+ */
+
+enum { MT_IDLE, MT_ON, MT_OFF };
+
+// a live block, in an open-addressed table keyed by address
+struct mt_slot {
+  void *p;
+  int id;
+};
+
+static int mt_state;
+static int mt_pid;
+static int mt_wfd, mt_rfd;         // the body, written and read back
+static struct mt_slot *mt_map;
+static uint mt_cap, mt_live;       // mt_cap is a power of two
+static int *mt_free_ids;           // ids of freed blocks, handed out again
+static int mt_nfree, mt_next_id;
+static uint mt_ops;
+static char mt_buf[1024];
+static int mt_len;
+
+static char*
+mt_name(char *buf, char *ext)
+{
+  char num[12];
+  int n = 0, pid = mt_pid;
+
+  strcpy(buf, "mtrace.");
+  do {
+    num[n++] = '0' + pid % 10;
+  } while((pid /= 10) != 0);
+  char *p = buf + strlen(buf);
+  while(n > 0)
+    *p++ = num[--n];
+  strcpy(p, ext);
+  return buf;
+}
+
+static void
+mt_write(int fd)
+{
+  if(mt_len > 0 && write(fd, mt_buf, mt_len) != mt_len)
+    mt_state = MT_OFF;
+  mt_len = 0;
+}
+
+static void
+mt_putc(char c)
+{
+  if(mt_len == sizeof(mt_buf))
+    mt_write(mt_wfd);
+  mt_buf[mt_len++] = c;
+}
+
+static void
+mt_putnum(uint x)
+{
+  char num[10];
+  int n = 0;
+
+  do {
+    num[n++] = '0' + x % 10;
+  } while((x /= 10) != 0);
+  while(n > 0)
+    mt_putc(num[--n]);
+}
+
+static uint
+mt_hash(void *p)
+{
+  return ((uint64)p >> 4) * 2654435761u & (mt_cap - 1);
+}
+
+static void
+mt_insert(void *p, int id)
+{
+  uint i;
+
+  for(i = mt_hash(p); mt_map[i].p; i = (i + 1) & (mt_cap - 1))
+    ;
+  mt_map[i].p = p;
+  mt_map[i].id = id;
+}
+
+// an empty table of cap slots, and room for as many free ids
+static int
+mt_alloc(uint cap)
+{
+  mt_map = kr_malloc(cap * sizeof(struct mt_slot));
+  mt_free_ids = kr_malloc(cap * sizeof(int));
+  if(mt_map == 0 || mt_free_ids == 0)
+    return -1;
+  memset(mt_map, 0, cap * sizeof(struct mt_slot));
+  mt_cap = cap;
+  return 0;
+}
+
+// keep the table at most half full; twice as many slots otherwise
+static int
+mt_grow(void)
+{
+  struct mt_slot *old = mt_map;
+  int *old_ids = mt_free_ids;
+  uint old_cap = mt_cap;
+
+  if(mt_alloc(2 * old_cap) < 0)
+    return -1;
+  for(uint i = 0; i < old_cap; i++)
+    if(old[i].p)
+      mt_insert(old[i].p, old[i].id);
+  memmove(mt_free_ids, old_ids, mt_nfree * sizeof(int));
+  kr_free(old);
+  kr_free(old_ids);
+  return 0;
+}
+
+static void
+mt_start(void)
+{
+  char name[24];
+
+  mt_state = MT_OFF;
+  mt_pid = getpid();
+  mt_name(name, ".tmp");
+  mt_wfd = open(name, O_CREATE | O_WRONLY | O_TRUNC);
+  if(mt_wfd < 0)
+    return;
+  mt_rfd = open(name, O_RDONLY);
+  unlink(name);
+  if(mt_rfd < 0){
+    close(mt_wfd);
+    return;
+  }
+  if(mt_map == 0 && mt_alloc(256) < 0)
+    return;
+  memset(mt_map, 0, mt_cap * sizeof(struct mt_slot));
+  mt_live = mt_nfree = mt_next_id = mt_ops = mt_len = 0;
+  mt_state = MT_ON;
+}
+
+static void
+mt_alloced(void *p, uint nbytes)
+{
+  int id;
+
+  if(mt_state == MT_IDLE)
+    mt_start();
+  if(mt_state != MT_ON || p == 0)
+    return;
+  if(2 * (mt_live + 1) > mt_cap && mt_grow() < 0){
+    mt_state = MT_OFF;
+    return;
+  }
+  id = mt_nfree > 0 ? mt_free_ids[--mt_nfree] : mt_next_id++;
+  mt_insert(p, id);
+  mt_live++;
+  mt_ops++;
+  mt_putc('a');
+  mt_putc(' ');
+  mt_putnum(id);
+  mt_putc(' ');
+  mt_putnum(nbytes);
+  mt_putc('\n');
+}
+
+static void
+mt_freed(void *p)
+{
+  uint i, j, h;
+
+  if(mt_state != MT_ON || p == 0)
+    return;
+  for(i = mt_hash(p); mt_map[i].p != p; i = (i + 1) & (mt_cap - 1))
+    if(mt_map[i].p == 0)
+      return;
+  mt_free_ids[mt_nfree++] = mt_map[i].id;
+  mt_live--;
+  mt_ops++;
+  mt_putc('f');
+  mt_putc(' ');
+  mt_putnum(mt_map[i].id);
+  mt_putc('\n');
+  // close the gap, so that no probe for a later entry stops at it
+  mt_map[i].p = 0;
+  for(j = (i + 1) & (mt_cap - 1); mt_map[j].p; j = (j + 1) & (mt_cap - 1)){
+    h = mt_hash(mt_map[j].p);
+    if(((j - h) & (mt_cap - 1)) >= ((j - i) & (mt_cap - 1))){
+      mt_map[i] = mt_map[j];
+      mt_map[j].p = 0;
+      i = j;
+    }
+  }
+}
+
+void*
+malloc(uint nbytes)
+{
+  void *p = kr_malloc(nbytes);
+  mt_alloced(p, nbytes);
+  return p;
+}
+
+void
+free(void *ap)
+{
+  mt_freed(ap);
+  kr_free(ap);
+}
+
+// write mtrace.<pid>.rep: the counts, then the body read back
+void
+mtrace_flush(void)
+{
+  char name[24];
+  int fd, n;
+
+  if(mt_state != MT_ON)
+    return;
+  mt_write(mt_wfd);
+  close(mt_wfd);
+  mt_state = MT_OFF;
+  fd = open(mt_name(name, ".rep"), O_CREATE | O_WRONLY | O_TRUNC);
+  if(fd >= 0){
+    mt_wfd = fd;
+    mt_putnum(mt_next_id);
+    mt_putc('\n');
+    mt_putnum(mt_ops);
+    mt_putc('\n');
+    mt_write(fd);
+    while((n = read(mt_rfd, mt_buf, sizeof(mt_buf))) > 0)
+      if(write(fd, mt_buf, n) != n)
+        break;
+    close(fd);
+  }
+  close(mt_rfd);
+}
+
+// in the child of a fork: the files and the buffered ops are the parent's
+void
+mtrace_forked(void)
+{
+  if(mt_state == MT_ON){
+    close(mt_wfd);
+    close(mt_rfd);
+  }
+  mt_len = 0;
+  mt_state = MT_IDLE;
+}
+#endif
@@ -13,6 +13,14 @@
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
 //#define LAST
+/* index the last (unbounded) size class with a splay tree instead of a sorted list */
+#define TREE
+/* serve requests up to SLAB_MAX bytes from headerless slots in aligned slab pages */
+#define SLAB
+/* keep freed small blocks allocated on exact-size LIFO lists for quick reuse */
+#define QUICK
+/* count allocator events for mm_stats; without it the counting compiles away */
+//#define STATS
 
 #define SIZE_T_SIZE (ALIGN(sizeof(uint)))
 /*
@@ -22,41 +30,197 @@
 char *heap_listp;
 char *seg_listp;
 char *align_listp;
+char *heap_end; /* current break, kept by mem_sbrk */
+char *heap_clean; /* nothing at or above it was ever handed out since sbrk */
 
 #define WSIZE 4 /* Word and header/footer size (bytes) */
 #define DSIZE 8 /* Double word size (bytes) */
 #define CHUNKSIZE (1<<12) /* Extend heap by this amount (bytes) */
+#define PGSIZE 4096 /* The kernel hands out memory in zeroed pages of this size */
+#define PGROUNDUP(p) ((char *)(((uint64)(p) + PGSIZE - 1) & ~(uint64)(PGSIZE - 1)))
+#define NUM_LISTS 13 /* Number of segregated free lists */
+#define SLAB_MAX 64 /* Largest request served by the slab tier (bytes) */
+#define SLAB_SIZE 4096 /* Size and alignment of a slab page (bytes) */
+#define SLAB_WARMUP 16 /* Requests of a class served by the lists before it gets a page */
+#define QUICK_MAX 512 /* Largest block cached on a quick list (bytes) */
+#define QUICK_LIMIT 32 /* Blocks a quick list holds before it is flushed */
+#define GROW_STEP_MAX (1<<16) /* Largest step the heap grows by beyond a request (bytes) */
+#define GROW_WINDOW 32 /* Growths closer than this many mallocs double the step */
+#define TRIM_THRESHOLD (1<<18) /* Free bytes at the heap end that trigger a trim */
+#define TRIM_KEEP GROW_STEP_MAX /* Free bytes a trim leaves at the heap end */
+#define GROW_CAP (1<<18) /* Most slack a repeatedly grown block is given (bytes) */
+#define SBRK_MAX 0x7fffffff /* Most the heap can grow by at once: mem_sbrk takes an int */
 
 /* @structure of the block:
  *
- * 1. we use an 8-byte header to store the size of the block
- * and whether the block is allocated.
+ * 1. we use a 4-byte header to store the size of the block,
+ * whether the block is allocated (a), whether the block right
+ * before it is allocated (pa) and whether realloc has grown it (g).
  *
- *  31       | 3  2 | 1  0 |
- *  ------------------------
- *  |  size  | null |   p  |
+ *  31       |  2  |  1  |  0  |
+ *  ------------------------------
+ *  |  size  |  g  |  pa |  a  |
  *
  * 2. we use two 4-byte pointers to store prev/next free-node pointer.
  * 3. we store the payload in the middle of the block.
  * 4. we store the padding part to align the block.
- * 5. we use an 4-byte footer to store the size of the block
+ * 5. only a free block has a 4-byte footer with its size; an allocated
+ * block lends that word to its payload, since the next block learns
+ * whether it may look for a footer from its own pa bit.
  *
  * - bp is pointed at the beginning of #2
+ * - bp is always 8-byte aligned
  */
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define PACK(size, alloc) ((size) | (alloc))
 #define GET(p) (*(uint *)(p))
 #define PUT(p, val) (*(uint *)(p) = (val))
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define PREV_ALLOC 0x2
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define SET_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
+/*
+ * pristine memory (at or above heap_clean) is zero except for the tags of
+ * the free blocks in it, so a tag left inside a merged block is zeroed
+ */
+#define SCRUB(p) do { if ((char *)(p) >= heap_clean) PUT(p, 0); } while (0)
+#define SCRUB_SEAM(bp) do { SCRUB((char *)(bp) - DSIZE); SCRUB(HDRP(bp)); \
+    SCRUB(bp); SCRUB((char *)(bp) + WSIZE); } while (0)
+/* memory below end has been handed out */
+#define TOUCH(end) do { if ((char *)(end) > heap_clean) heap_clean = (char *)(end); } while (0)
+/* only allocated blocks carry it; any header rewrite drops it */
+#define GROWN 0x4
+#define GET_GROWN(p) (GET(p) & GROWN)
+#define SET_GROWN(bp) PUT(HDRP(bp), GET(HDRP(bp)) | GROWN)
 #define HDRP(bp) ((char *)(bp) - WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+/* only valid when the previous block is free */
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* free list storage */
 #define PREV_FREE(bp) ((char *)(bp))
 #define NEXT_FREE(bp) ((char *)(bp + WSIZE))
+/*
+ * free-list (and tree, slab page) links are 32-bit offsets from heap_listp,
+ * so they stay 4 bytes wide wherever the heap is mapped. every block lies
+ * above heap_listp, which leaves offset 0 free to mean "none".
+ * ENCODE evaluates its argument twice, so pass it a plain variable.
+ */
+#define ENCODE(p) ((p) ? (uint)((char *)(p) - heap_listp) : 0)
+#define DECODE(v) ((v) ? heap_listp + (v) : (char *)0)
+#define GET_PTR(p) DECODE(GET(p))
+#define PUT_PTR(p, ptr) PUT(p, ENCODE(ptr))
+/* bitmap of non-empty lists, kept in the word right after the list heads */
+#define GET_MAP() GET(align_listp)
+#define SET_MAP(i) PUT(align_listp, GET_MAP() | (1u << (i)))
+#define CLR_MAP(i) PUT(align_listp, GET_MAP() & ~(1u << (i)))
+#define LOWEST_BIT(x) (debruijn_table[(((x) & -(x)) * 0x077CB531u) >> 27])
+/* splay tree storage, reusing the two free-list words of a free block */
+#define TREE_LIST (NUM_LISTS - 1)
+#define LEFT(bp) PREV_FREE(bp)
+#define RIGHT(bp) NEXT_FREE(bp)
+#define NODE(p) GET_PTR(p)
+/* tree nodes are ordered by (size, address) so that every key is unique */
+#define KEY_LT(s1, a1, s2, a2) ((s1) < (s2) || ((s1) == (s2) && (a1) < (a2)))
+
+/* @structure of a slab page:
+ *
+ * a slab page is an ordinary allocated block whose payload starts on a
+ * SLAB_SIZE boundary and ends right before the header of the next
+ * boundary, so the pages of a class tile without gaps when adjacent.
+ * its payload holds
+ *
+ * 1. two 4-byte pointers linking the partial pages (any slot free) of a class
+ * 2. the slot size and the number of free slots
+ * 3. a bitmap of free slots, bit set = free
+ * 4. the slots themselves, with no header or footer
+ *
+ * a slot finds its page by masking off the low bits of its address, and a
+ * bitmap of the heap's pages (slab_map) tells slab pages from other blocks.
+ */
+#define SLAB_PAYLOAD (SLAB_SIZE - WSIZE)
+#define SLAB_WORDS 16 /* bitmap words, enough for SLAB_PAYLOAD / 8 slots */
+#define SLAB_HDR ((4 + SLAB_WORDS) * WSIZE)
+#define SLAB_NEXT(pg) ((char *)(pg))
+#define SLAB_PREV(pg) ((char *)(pg) + WSIZE)
+#define SLAB_SLOT(pg) ((char *)(pg) + 2 * WSIZE)
+#define SLAB_NFREE(pg) ((char *)(pg) + 3 * WSIZE)
+#define SLAB_BITS(pg) ((char *)(pg) + 4 * WSIZE)
+#define SLAB_COUNT(slot) ((SLAB_PAYLOAD - SLAB_HDR) / (slot))
+#define SLAB_PAGE(p) ((char *)((uint64)(p) & ~(uint64)(SLAB_SIZE - 1)))
+#define SLAB_MAP_WORDS 1024 /* covers 1024 * 32 slab pages of heap */
+
+char *slab_base;
+uint slab_map[SLAB_MAP_WORDS];
+char *slab_partial[SLAB_MAX / ALIGNMENT + 1];
+uint slab_seen[SLAB_MAX / ALIGNMENT + 1];
+
+/*
+ * quick lists, one per block size up to QUICK_MAX: freed blocks that keep
+ * their allocated header and are chained LIFO through their first payload
+ * word, so a free followed by a malloc of the same size is a push and a pop.
+ * they are coalesced in one batch when a list overflows or malloc misses.
+ */
+char *quick_list[QUICK_MAX / DSIZE + 1];
+uint quick_count[QUICK_MAX / DSIZE + 1];
+uint quick_total;
+
+/* growth policy state: the current step, and when the heap last grew */
+size_t grow_step;
+uint malloc_count;
+uint last_grow;
+
+#ifdef STATS
+/*
+ * event counters for mm_stats. a walk histogram counts searches by how
+ * many list nodes they visited, in buckets 0, 1, 2-3, 4-7, ... with the
+ * last one taking the rest; the tree counts as a single node.
+ */
+#define WALK_BUCKETS 10
+struct {
+  uint allocated; /* usable bytes of the blocks the caller holds */
+  uint peak;
+  uint splits;
+  uint coalesces; /* neighbours merged into a block */
+  uint realloc_inplace;
+  uint realloc_copy;
+  uint sbrk_calls;
+  uint walk; /* nodes visited by the current search */
+  uint fit_walk[WALK_BUCKETS];
+  uint insert_walk[WALK_BUCKETS];
+} stats;
+#define STAT(x) (x)
+#else
+#define STAT(x)
+#endif
+
+/*
+ * size classes of the segregated lists, indexed by list number:
+ * (0, 8], (8, 16], (16, 32], (32, 72], (72, 136], ... (8200, 16392], (16392, inf)
+ *
+ * the mapping is done with two small tables instead of an if/else chain:
+ * sizes up to 72 are looked up directly by (size / 8), and for the rest
+ * list k (4 <= k <= 11) holds (2^(k+2) + 8, 2^(k+3) + 8], so the index is
+ * floor(log2(size - 9)) - 2, read from a byte-wide log2 table.
+ */
+static const char small_class[10] = {0, 0, 1, 2, 2, 3, 3, 3, 3, 3};
+
+#define LT(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+static const char log_table[256] = {
+  -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+  LT(4), LT(5), LT(5), LT(6), LT(6), LT(6), LT(6),
+  LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7)
+};
+
+/* index of the lowest set bit, by de Bruijn multiplication */
+static const char debruijn_table[32] = {
+  0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+  31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
 
 
 
@@ -68,49 +232,145 @@ void mm_free(void *ptr);
 
 void *mm_realloc(void *ptr, uint size);
 
+int mm_trim(uint pad);
+
+int mm_malloc_batch(uint size, int n, void **out);
+
+void mm_free_batch(void **ptrs, int n);
+
+void *mm_calloc(uint n, uint size);
+
+void *mm_memalign(uint alignment, uint size);
+
+void mm_free_sized(void *ptr, uint size);
+
+uint mm_usable_size(void *ptr);
+
+void mm_stats(void);
+
+void *mm_aligned_alloc(uint alignment, uint size);
+
 void *find_fit(size_t asize);
 
+void *find_or_extend(size_t asize);
+
+int malloc_each(uint size, int n, void **out);
+
 void place(void *bp, size_t asize, int exist);
 
 void *coalesce(void *bp, int realloc, int target_size);
 
 void *extend_heap(size_t words);
 
+size_t grow_size(size_t asize);
+
+void *mem_sbrk(int incr);
+
+int trim_tail(char *bp, size_t pad);
+
+int fit_index(size_t asize);
+
 char *fit_list(size_t asize);
 
 void remove_node(char *bp);
 
 void insert_node(char *bp);
 
+char *splay(char *t, size_t size, char *addr);
+
+char *tree_fit(size_t asize);
+
+void tree_remove(char *bp);
+
+void tree_insert(char *bp);
+
+void *grow_in_place(char *bp, size_t asize);
+
+void *alloc_aligned(size_t alignment, size_t size);
+
+char *aligned_bp(char *bp, size_t alignment);
+
+char *find_aligned_fit(size_t alignment, size_t asize);
+
+int is_slab(void *ptr);
+
+void *slab_alloc(uint size);
+
+void slab_free(void *ptr);
+
+void quick_flush(int index);
+
+void free_block(char *bp);
+
+void release_block(char *bp);
+
+void sort_ptrs(void **ptrs, int n);
+
+void clear(char *p, size_t bytes);
+
 void put_old_node(char *bp, size_t size, int alloc);
 
-void put_new_node(char *bp, size_t size, int alloc);
+void put_new_node(char *bp, size_t size, int prev_alloc);
 
 size_t align(size_t size);
 
+#ifdef STATS
+void stat_add(int delta);
+
+void stat_walk(uint *hist);
+#endif
+
 /*
  * @brief initialize the malloc package.
  * we use segregated free-list to manage the free blocks.
  * the block sizes are from 2^3 to 2^14 and beyond
  *
- * we store the head of each free-list in the heap beginning
+ * we store the head of each free-list in the heap beginning,
+ * followed by a bitmap word whose bit i is set iff list i is non-empty
+ *
+ * the heap itself is started on an 8-byte boundary, which keeps every bp
+ * 8-byte aligned
  */
 int mm_init(void) {
-  if ((heap_listp = sbrk(17 * WSIZE)) == (void *) -1)
+  size_t pad = (-(uint64) sbrk(0)) & (DSIZE - 1);
+
+  STAT(memset(&stats, 0, sizeof(stats)));
+  if ((heap_listp = mem_sbrk(pad + 18 * WSIZE)) == (void *) -1)
     return -1;
+  heap_listp += pad;
+  // the page the break sits in may hold leftovers of an earlier, trimmed heap
+  heap_clean = PGROUNDUP(heap_end);
 
-  for (int i = 3; i <= 15; i++) {
-    PUT(heap_listp + ((i - 3) * WSIZE), 0);
+  for (int i = 0; i < NUM_LISTS; i++) {
+    PUT(heap_listp + (i * WSIZE), 0);
   }
 
-  PUT(heap_listp + (13 * WSIZE), 0);              /* Alignment padding */
-  PUT(heap_listp + (14 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
-  PUT(heap_listp + (15 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
-  PUT(heap_listp + (16 * WSIZE), PACK(0, 1)); /* Epilogue header */
+  PUT(heap_listp + (13 * WSIZE), 0);              /* Non-empty list bitmap */
+  PUT(heap_listp + (14 * WSIZE), 0);              /* Alignment padding */
+  PUT(heap_listp + (15 * WSIZE), PACK(DSIZE, 1) | PREV_ALLOC); /* Prologue header */
+  PUT(heap_listp + (16 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+  PUT(heap_listp + (17 * WSIZE), PACK(0, 1) | PREV_ALLOC); /* Epilogue header */
 
   seg_listp = heap_listp;
-  heap_listp += (15 * WSIZE);
-  align_listp = heap_listp - (2 * WSIZE);
+  heap_listp += (16 * WSIZE);
+  align_listp = seg_listp + (13 * WSIZE);
+
+  slab_base = SLAB_PAGE(seg_listp);
+  for (int i = 0; i < SLAB_MAP_WORDS; i++) {
+    slab_map[i] = 0;
+  }
+  for (int i = 0; i <= SLAB_MAX / ALIGNMENT; i++) {
+    slab_partial[i] = 0;
+    slab_seen[i] = 0;
+  }
+  for (int i = 0; i <= QUICK_MAX / DSIZE; i++) {
+    quick_list[i] = 0;
+    quick_count[i] = 0;
+  }
+  quick_total = 0;
+  grow_step = CHUNKSIZE;
+  malloc_count = 0;
+  last_grow = 0;
 
 #ifdef DEBUG
   printf("heap_listp: %p\n", heap_listp);
@@ -133,28 +393,36 @@ void *mm_malloc(uint size) {
   printf("mm_malloc: %d\n", size);
 #endif
   size_t asize = align(size); /* Adjusted block size */
-  size_t extendsize; /* Amount to extend heap if no fit */
   char *bp;
 
   if (size == 0)
     return 0;
 
-  if ((bp = find_fit(asize)) != 0) {
-#ifdef REALLOC
-    printf("find fit: %p\n", bp);
-#endif
-    place(bp, asize, 1);
+#ifdef SLAB
+  if (size <= SLAB_MAX && (bp = slab_alloc(size)) != 0) {
+    STAT(stat_add(mm_usable_size(bp)));
     return bp;
-  } else {
-    extendsize = asize;
-    if ((bp = extend_heap(extendsize / WSIZE)) == 0)
-      return 0;
-#ifdef REALLOC
-    printf("find fit: %p\n", bp);
+  }
 #endif
-    place(bp, asize, 1);
+#ifdef QUICK
+  if (asize <= QUICK_MAX && (bp = quick_list[asize / DSIZE]) != 0) {
+    quick_list[asize / DSIZE] = GET_PTR(bp);
+    quick_count[asize / DSIZE]--;
+    quick_total--;
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~GROWN);
+    STAT(stat_add(mm_usable_size(bp)));
     return bp;
   }
+#endif
+
+  if ((bp = find_or_extend(asize)) == 0)
+    return 0;
+#ifdef REALLOC
+  printf("find fit: %p\n", bp);
+#endif
+  place(bp, asize, 1);
+  STAT(stat_add(mm_usable_size(bp)));
+  return bp;
 }
 
 /*
@@ -164,10 +432,14 @@ void mm_free(void *ptr) {
 #ifdef DEBUG
   printf("mm_free: %p\n", ptr);
 #endif
-  size_t size = GET_SIZE(HDRP(ptr));
-
-  put_new_node(ptr, size, 0);
-  coalesce(ptr, 0, 0);
+  STAT(stat_add(-(int) mm_usable_size(ptr)));
+#ifdef SLAB
+  if (is_slab(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+  release_block(ptr);
 }
 
 /*
@@ -184,38 +456,351 @@ void *mm_realloc(void *ptr, uint size) {
   } else if (size == 0) {
     mm_free(ptr);
     return 0;
+#ifdef SLAB
+  } else if (is_slab(ptr)) {
+    uint slot = GET(SLAB_SLOT(SLAB_PAGE(ptr)));
+    if (size <= slot) {
+      STAT(stats.realloc_inplace++);
+      return ptr;
+    }
+    if ((newptr = mm_malloc(size)) == 0) {
+      return 0;
+    }
+    memcpy(newptr, ptr, slot);
+    slab_free(ptr);
+    STAT(stat_add(-(int) slot));
+    STAT(stats.realloc_copy++);
+    return newptr;
+#endif
   } else {
     size_t origin_size = GET_SIZE(HDRP(ptr));
     size_t asize = align(size);
+    size_t grown = GET_GROWN(HDRP(ptr));
+    size_t want = asize;
 
-    if (asize == origin_size) {
+    if (asize <= origin_size && asize >= origin_size / 2) {
+      // it fits, and splitting would give back too little to be worth it
+      // (for a grown block this is the slack kept for its next growth)
+      STAT(stats.realloc_inplace++);
       return ptr;
     } else if (asize < origin_size) { // same as placing a node here
       // but we can't remove bp as it doesn't exist in linklist
       place(ptr, asize, 0);
+      STAT(stat_add((int) GET_SIZE(HDRP(ptr)) - (int) origin_size));
+      STAT(stats.realloc_inplace++);
       return ptr;
-    } else {
-      void *new_bp = coalesce(ptr, 1, asize);
-      if (GET_SIZE(HDRP(new_bp)) >= asize) {
-        if (new_bp != ptr) {
-          memcpy(new_bp, ptr, size);
-          place(new_bp, asize, 0);
-        } else {
-          place(new_bp, asize, 0);
-        }
-        return new_bp;
+    }
+
+    if (asize > SBRK_MAX) {
+      // no block gets this big, and want - WSIZE could wrap mm_malloc's uint
+      return 0;
+    }
+    if (grown) {
+      // grown before: reserve geometric slack so appends amortise to O(1)
+      want = asize + MIN(asize, GROW_CAP);
+    }
+
+    void *new_bp = coalesce(ptr, 1, asize);
+    if (GET_SIZE(HDRP(new_bp)) >= asize) {
+      if (new_bp != ptr) {
+        // the blocks overlap when we merged the previous one
+        memmove(new_bp, ptr, origin_size - WSIZE);
+        STAT(stats.realloc_copy++);
       } else {
-        // we didn't merge block as it doesn't help
-        newptr = mm_malloc(size);
-        if (newptr == 0) {
-          return 0;
-        }
-        memcpy(newptr, ptr, size);
-        mm_free(ptr);
+        STAT(stats.realloc_inplace++);
+      }
+      place(new_bp, MIN(want, GET_SIZE(HDRP(new_bp))), 0);
+      SET_GROWN(new_bp);
+      STAT(stat_add((int) GET_SIZE(HDRP(new_bp)) - (int) origin_size));
+      return new_bp;
+    } else if (grow_in_place(ptr, want) != 0) {
+      // the block was the last one, the heap grew under it
+      SET_GROWN(ptr);
+      STAT(stat_add((int) GET_SIZE(HDRP(ptr)) - (int) origin_size));
+      STAT(stats.realloc_inplace++);
+      return ptr;
+    } else {
+      // we didn't merge block as it doesn't help
+      newptr = mm_malloc(want - WSIZE);
+      if (newptr == 0) {
+        return 0;
+      }
+      memcpy(newptr, ptr, origin_size - WSIZE);
+      mm_free(ptr);
+      STAT(stats.realloc_copy++);
+#ifdef SLAB
+      if (is_slab(newptr)) {
         return newptr;
       }
+#endif
+      SET_GROWN(newptr);
+      return newptr;
+    }
+  }
+}
+
+/*
+ * @brief give the free memory at the end of the heap back to the kernel,
+ * keeping pad bytes of it for future requests.
+ * returns 1 if the heap shrank, 0 otherwise.
+ */
+int mm_trim(uint pad) {
+#ifdef QUICK
+  // cached blocks may be all that keeps the end of the heap allocated
+  for (int i = 0; i <= QUICK_MAX / DSIZE; i++) {
+    quick_flush(i);
+  }
+#endif
+  if (GET_PREV_ALLOC(heap_end - WSIZE)) {
+    return 0;
+  }
+  return trim_tail(heap_end - GET_SIZE(heap_end - DSIZE), pad);
+}
+
+/*
+ * @brief allocate n blocks of size bytes each into out[0..n-1].
+ *
+ * the blocks are carved back to back out of one free region, which is
+ * found by a single search and taken off its list once. sizes the slab
+ * serves are handed out one by one, since a slot is already cheap, and so
+ * are all of them when no free region holds the whole batch: growing the
+ * heap for one would leave the fragments that do hold them unused.
+ * returns n, or 0 with nothing allocated.
+ */
+int mm_malloc_batch(uint size, int n, void **out) {
+  size_t asize = align(size);
+  char *bp;
+
+  if (size == 0 || n <= 0)
+    return 0;
+
+#ifdef SLAB
+  if (size <= SLAB_MAX)
+    return malloc_each(size, n, out);
+#endif
+
+  if ((bp = find_fit(asize * n)) == 0)
+    return malloc_each(size, n, out);
+  malloc_count++;
+  place(bp, asize * n, 1);
+
+  // the last block keeps whatever sliver place() could not split off
+  size_t csize = GET_SIZE(HDRP(bp));
+  for (int i = 0; i < n; i++, bp += asize) {
+    size_t bsize = i == n - 1 ? csize - i * asize : asize;
+    PUT(HDRP(bp), PACK(bsize, 1) | (i == 0 ? GET_PREV_ALLOC(HDRP(bp)) : PREV_ALLOC));
+    STAT(stat_add(bsize - WSIZE));
+    out[i] = bp;
+  }
+  return n;
+}
+
+/*
+ * @brief allocate n blocks of size bytes each into out[0..n-1] with one
+ * mm_malloc apiece. returns n, or 0 with nothing allocated.
+ */
+int malloc_each(uint size, int n, void **out) {
+  for (int i = 0; i < n; i++) {
+    if ((out[i] = mm_malloc(size)) == 0) {
+      mm_free_batch(out, i);
+      return 0;
+    }
+  }
+  return n;
+}
+
+/*
+ * @brief free the n blocks in ptrs (null entries are skipped), leaving
+ * ptrs sorted by address.
+ *
+ * blocks that lie back to back in the heap are merged into one free block
+ * before it is coalesced with its neighbours, so a run of them costs a
+ * single list insertion. they bypass the quick lists.
+ */
+void mm_free_batch(void **ptrs, int n) {
+  sort_ptrs(ptrs, n);
+
+  for (int i = 0; i < n;) {
+    char *bp = ptrs[i++];
+    if (bp == 0) {
+      continue;
+    }
+    STAT(stat_add(-(int) mm_usable_size(bp)));
+#ifdef SLAB
+    if (is_slab(bp)) {
+      slab_free(bp);
+      continue;
+    }
+#endif
+    // no slab slot starts right at a block, so a run is plain blocks
+    size_t size = GET_SIZE(HDRP(bp));
+    while (i < n && (char *) ptrs[i] == bp + size) {
+      STAT(stat_add(-(int) mm_usable_size(ptrs[i])));
+      size += GET_SIZE(HDRP(ptrs[i++]));
+    }
+    PUT(HDRP(bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    free_block(bp);
+  }
+}
+
+/*
+ * @brief allocate zeroed memory for n objects of size bytes each.
+ *
+ * sbrk only hands out zeroed pages and the allocator writes nothing but
+ * free-block tags above heap_clean, so just the part of the block below
+ * heap_clean is cleared, plus the links and footer the block inherited
+ * from the free block it was carved from.
+ */
+void *mm_calloc(uint n, uint size) {
+  char *clean = heap_clean;
+  char *bp;
+
+  if (n != 0 && size > (uint) -1 / n) {
+    return 0;
+  }
+  size *= n;
+  if ((bp = mm_malloc(size)) == 0) {
+    return 0;
+  }
+
+  char *end = bp + size;
+  if (bp < clean) {
+    clear(bp, MIN(end, clean) - bp);
+  }
+  if (end > clean) {
+    char *tags[3] = {bp, bp + WSIZE, NEXT_BLKP(bp) - DSIZE};
+    for (int i = 0; i < 3; i++) {
+      if (tags[i] >= clean && tags[i] < end) {
+        PUT(tags[i], 0);
+      }
+    }
+  }
+  return bp;
+}
+
+/*
+ * @brief allocate size bytes at an address that is a multiple of
+ * alignment, which must be a power of two.
+ *
+ * the slack in front of the aligned block goes back to the lists as a
+ * free block, so an alignment costs no more than the split it needs.
+ */
+void *mm_memalign(uint alignment, uint size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return 0;
+  }
+  if (alignment <= ALIGNMENT) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    return 0;
+  }
+  void *bp = alloc_aligned(alignment, size);
+  STAT(stat_add(mm_usable_size(bp)));
+  return bp;
+}
+
+/*
+ * @brief the C11 flavour of mm_memalign: size must be a multiple of
+ * alignment.
+ */
+void *mm_aligned_alloc(uint alignment, uint size) {
+  if (alignment == 0 || size % alignment != 0) {
+    return 0;
+  }
+  return mm_memalign(alignment, size);
+}
+
+/*
+ * @brief mm_free for callers that know the size they asked for.
+ *
+ * a size above SLAB_MAX cannot be a slab slot, so the common case skips
+ * the slab_map probe. the quick list still goes by the header, as the
+ * block may be larger than the size asked for.
+ */
+void mm_free_sized(void *ptr, uint size) {
+#ifdef DEBUG
+  printf("mm_free_sized: %p, size: %d\n", ptr, size);
+  if (size > mm_usable_size(ptr)) {
+    printf("mm_free_sized: %p only holds %d bytes\n", ptr, mm_usable_size(ptr));
+  }
+#endif
+  STAT(stat_add(-(int) mm_usable_size(ptr)));
+#ifdef SLAB
+  if (size <= SLAB_MAX && is_slab(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+  release_block(ptr);
+}
+
+/*
+ * @brief the number of bytes the caller may use at ptr, which is at least
+ * what it asked for.
+ */
+uint mm_usable_size(void *ptr) {
+  if (ptr == 0) {
+    return 0;
+  }
+#ifdef SLAB
+  if (is_slab(ptr)) {
+    return GET(SLAB_SLOT(SLAB_PAGE(ptr)));
+  }
+#endif
+  // an allocated block has no footer, the payload runs up to the next header
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/*
+ * @brief print what the allocator holds and what it has been doing since
+ * mm_init. the free blocks are counted by walking the heap, so this is
+ * slow and meant for the end of a run. prints nothing without STATS.
+ */
+void mm_stats(void) {
+#ifdef STATS
+  uint count[NUM_LISTS], bytes[NUM_LISTS];
+
+  for (int i = 0; i < NUM_LISTS; i++) {
+    count[i] = bytes[i] = 0;
+  }
+  for (char *bp = heap_listp; GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp)) {
+    if (!GET_ALLOC(HDRP(bp))) {
+      count[fit_index(GET_SIZE(HDRP(bp)))]++;
+      bytes[fit_index(GET_SIZE(HDRP(bp)))] += GET_SIZE(HDRP(bp));
+    }
+  }
+
+  printf("allocated : %d bytes, peak %d bytes\n", stats.allocated, stats.peak);
+  printf("heap size : %d bytes\n", heap_end - seg_listp);
+  for (int i = 0; i < NUM_LISTS; i++) {
+    if (count[i] != 0) {
+      printf("list %d : %d free blocks, %d bytes\n", i, count[i], bytes[i]);
     }
   }
+#ifdef QUICK
+  uint quick_bytes = 0;
+  for (int i = 0; i <= QUICK_MAX / DSIZE; i++) {
+    quick_bytes += quick_count[i] * i * DSIZE;
+  }
+  printf("quick lists : %d blocks, %d bytes\n", quick_total, quick_bytes);
+#endif
+  printf("splits : %d, coalesces : %d, sbrk calls : %d\n",
+         stats.splits, stats.coalesces, stats.sbrk_calls);
+  printf("realloc in place : %d, copied : %d\n",
+         stats.realloc_inplace, stats.realloc_copy);
+
+  // bucket i >= 1 starts at 2^(i-1) nodes
+  printf("find_fit walks :");
+  for (int i = 0; i < WALK_BUCKETS; i++) {
+    printf(" %d:%d", i == 0 ? 0 : 1 << (i - 1), stats.fit_walk[i]);
+  }
+  printf("\ninsert_node walks :");
+  for (int i = 0; i < WALK_BUCKETS; i++) {
+    printf(" %d:%d", i == 0 ? 0 : 1 << (i - 1), stats.insert_walk[i]);
+  }
+  printf("\n");
+#endif
 }
 
 
@@ -223,28 +808,71 @@ void *find_fit(size_t asize) {
 #ifdef LXY
   printf("fit_list: %p\n", fit_list(asize));
 #endif
-  // we have to repeatedly try from the first available to the end
-  for (char *bp = fit_list(asize); bp != align_listp; bp += WSIZE) {
+  // only lists at or above our class that hold any node are visited
+  uint map = GET_MAP() & (~0u << fit_index(asize));
+  while (map != 0) {
+    int index = LOWEST_BIT(map);
+    char *bp = seg_listp + index * WSIZE;
 #ifdef REALLOC
     printf("trying fit bp: %p\n", bp);
 #endif
-    char *node = (char *) ((uint64)GET(bp));
+#ifdef TREE
+    if (index == TREE_LIST) {
+      STAT(stats.walk++);
+      STAT(stat_walk(stats.fit_walk));
+      return tree_fit(asize);
+    }
+#endif
+    char *node = GET_PTR(bp);
     while (node != 0) {
 #ifdef REALLOC
       printf("node: %p\n", node);
       printf("node size: %d\n", GET_SIZE(HDRP(node)));
 #endif
+      STAT(stats.walk++);
       if (asize <= GET_SIZE(HDRP(node))) {
+        STAT(stat_walk(stats.fit_walk));
         return node;
       } else {
-        node = (char *) (uint64)GET(NEXT_FREE(node));
+        node = GET_PTR(NEXT_FREE(node));
       }
     }
+    map &= map - 1;
   }
 
+  STAT(stat_walk(stats.fit_walk));
   return 0;
 }
 
+/*
+ * @brief find a free block of at least asize bytes, growing the heap when
+ * none fits. the block is still on its list. returns 0 for a size the
+ * heap could never grow by, which would wrap negative in mem_sbrk.
+ */
+void *find_or_extend(size_t asize) {
+  char *bp;
+
+  if (asize > SBRK_MAX) {
+    return 0;
+  }
+  malloc_count++;
+  if ((bp = find_fit(asize)) != 0) {
+    return bp;
+  }
+#ifdef QUICK
+  if (quick_total != 0) {
+    // a miss: coalesce every cached block in one batch and look again
+    for (int i = 0; i <= QUICK_MAX / DSIZE; i++) {
+      quick_flush(i);
+    }
+    if ((bp = find_fit(asize)) != 0) {
+      return bp;
+    }
+  }
+#endif
+  return extend_heap(grow_size(asize) / WSIZE);
+}
+
 void place(void *bp, size_t asize, int exist) {
 #ifdef DEBUG
   printf("place: %p, size: %d\n", bp, asize);
@@ -255,22 +883,33 @@ void place(void *bp, size_t asize, int exist) {
   }
 
   if ((csize - asize) >= (2 * DSIZE)) {
-    PUT(HDRP(bp), PACK(asize, 1));
-    PUT(FTRP(bp), PACK(asize, 1));
+    PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
     bp = NEXT_BLKP(bp);
+    TOUCH(HDRP(bp));
 
     // the split node's size should be judged
     int new_size = csize - asize;
+    STAT(stats.splits++);
 
-    put_new_node(bp, new_size, 0);
+    put_new_node(bp, new_size, PREV_ALLOC);
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
     coalesce(bp, 0, 0);
   } else {
     put_old_node(bp, csize, 1);
+    TOUCH(HDRP(NEXT_BLKP(bp)));
   }
 }
 
+/*
+ * @brief merge bp with its free neighbours.
+ *
+ * when realloc is set, bp is an allocated block that wants to grow to
+ * target_size: neighbours are only merged if that reaches target_size,
+ * the result stays allocated without a footer, and it is not put on a
+ * list. either way the merged block's previous block is allocated.
+ */
 void *coalesce(void *bp, int realloc, int target_size) {
-  size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
   size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 #ifdef REALLOC
   printf("bp: %p\n", bp);
@@ -288,29 +927,34 @@ void *coalesce(void *bp, int realloc, int target_size) {
     size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
     if (!realloc || size >= target_size) {
       remove_node(NEXT_BLKP(bp));
-      PUT(HDRP(bp), PACK(size, realloc));
-      PUT(FTRP(bp), PACK(size, realloc));
+      SCRUB_SEAM(NEXT_BLKP(bp));
+      PUT(HDRP(bp), PACK(size, realloc) | PREV_ALLOC);
+      STAT(stats.coalesces++);
     }
   } else if (next_alloc) {
     size += GET_SIZE(HDRP(PREV_BLKP(bp)));
     if (!realloc || size >= target_size) {
       remove_node(PREV_BLKP(bp));
-      PUT(FTRP(bp), PACK(size, realloc));
-      PUT(HDRP(PREV_BLKP(bp)), PACK(size, realloc));
       bp = PREV_BLKP(bp);
+      SCRUB_SEAM(NEXT_BLKP(bp));
+      PUT(HDRP(bp), PACK(size, realloc) | PREV_ALLOC);
+      STAT(stats.coalesces++);
     }
   } else {
-    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
+    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
     if (!realloc || size >= target_size) {
       remove_node(PREV_BLKP(bp));
       remove_node(NEXT_BLKP(bp));
-      PUT(HDRP(PREV_BLKP(bp)), PACK(size, realloc));
-      PUT(FTRP(NEXT_BLKP(bp)), PACK(size, realloc));
+      SCRUB_SEAM(NEXT_BLKP(bp));
       bp = PREV_BLKP(bp);
+      SCRUB_SEAM(NEXT_BLKP(bp));
+      PUT(HDRP(bp), PACK(size, realloc) | PREV_ALLOC);
+      STAT(stats.coalesces += 2);
     }
   }
 
   if (!realloc) {
+    PUT(FTRP(bp), PACK(size, 0));
     insert_node(bp);
   }
 
@@ -328,7 +972,7 @@ void *extend_heap(size_t words) {
   size_t size;
 
   size = words * WSIZE;
-  if ((long) (bp = sbrk(size)) == -1) {
+  if ((long) (bp = mem_sbrk(size)) == -1) {
 #ifdef REALLOC
     printf("sbrk failed\n");
 #endif
@@ -337,76 +981,113 @@ void *extend_heap(size_t words) {
 #ifdef DEBUG
   printf("extend_heap: %p\n", bp);
 #endif
-  put_new_node(bp, size, 0);
+  put_new_node(bp, size, GET_PREV_ALLOC(HDRP(bp))); /* Old epilogue header */
   PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
 
   return coalesce(bp, 0, 0);
 }
 
-char *fit_list(size_t asize) {
-#ifdef DEBUG
-  if (asize <= 8) {
-    printf("fit size: 8\n");
-  } else if (asize <= 16) {
-    printf("fit size: 16\n");
-  } else if (asize <= 32) {
-    printf("fit size: 32\n");
-  } else if (asize <= 64) {
-    printf("fit size: 64\n");
-  } else if (asize <= 128) {
-    printf("fit size: 128\n");
-  } else if (asize <= 256) {
-    printf("fit size: 256\n");
-  } else if (asize <= 512) {
-    printf("fit size: 512\n");
-  } else if (asize <= 1024) {
-    printf("fit size: 1024\n");
-  } else if (asize <= 2048) {
-    printf("fit size: 2048\n");
-  } else if (asize <= 4096) {
-    printf("fit size: 4096\n");
-  } else if (asize <= 8192) {
-    printf("fit size: 8192\n");
-  } else if (asize <= 16384) {
-    printf("fit size: 16384\n");
-  } else {
-    printf("fit size: 32768\n");
-  }
-#endif
-
-  if (asize <= 8) {
-    return seg_listp;
-  } else if (asize <= 16) {
-    return seg_listp + WSIZE;
-  } else if (asize <= 32) {
-    return seg_listp + 2 * WSIZE;
-  } else if (asize <= 72) {
-    return seg_listp + 3 * WSIZE;
-  } else if (asize <= 136) {
-    return seg_listp + 4 * WSIZE;
-  } else if (asize <= 264) {
-    return seg_listp + 5 * WSIZE;
-  } else if (asize <= 520) {
-    return seg_listp + 6 * WSIZE;
-  } else if (asize <= 1032) {
-    return seg_listp + 7 * WSIZE;
-  } else if (asize <= 2056) {
-    return seg_listp + 8 * WSIZE;
-  } else if (asize <= 4104) {
-    return seg_listp + 9 * WSIZE;
-  } else if (asize <= 8200) {
-    return seg_listp + 10 * WSIZE;
-  } else if (asize <= 16392) {
-    return seg_listp + 11 * WSIZE;
+/*
+ * @brief how many bytes to grow the heap by so that a block of asize fits.
+ *
+ * a free block right before the epilogue is merged with the new region,
+ * so only the rest of asize is missing. the heap grows by at least
+ * grow_step, which starts at CHUNKSIZE, doubles (up to GROW_STEP_MAX)
+ * while growths come within GROW_WINDOW mallocs of each other and halves
+ * again once they do not.
+ */
+size_t grow_size(size_t asize) {
+  size_t need = asize;
+
+  if (!GET_PREV_ALLOC(heap_end - WSIZE)) {
+    need -= GET_SIZE(heap_end - DSIZE);
+  }
+
+  if (malloc_count - last_grow < GROW_WINDOW) {
+    grow_step = MIN(grow_step * 2, GROW_STEP_MAX);
+  } else if (grow_step > CHUNKSIZE) {
+    grow_step /= 2;
+  }
+  last_grow = malloc_count;
+
+  return MAX(need, grow_step);
+}
+
+/*
+ * @brief sbrk, keeping heap_end at the break (and counting the calls
+ * for mm_stats).
+ */
+void *mem_sbrk(int incr) {
+  char *old = sbrk(incr);
+
+  STAT(stats.sbrk_calls++);
+  if ((long) old != -1) {
+    heap_end = old + incr;
+  }
+  return old;
+}
+
+/*
+ * @brief shrink bp, the free block right before the epilogue, to pad bytes
+ * (or drop it when pad is 0) and move the break down behind it.
+ * returns 1 if the heap shrank, 0 otherwise.
+ */
+int trim_tail(char *bp, size_t pad) {
+  size_t size = GET_SIZE(HDRP(bp));
+
+  pad = ALIGN(pad);
+  if (pad != 0 && pad < 2 * DSIZE) {
+    pad = 2 * DSIZE;
+  }
+  if (size <= pad) {
+    return 0;
+  }
+
+  remove_node(bp);
+  if (pad == 0) {
+    // the epilogue takes over the header of the block
+    PUT(HDRP(bp), PACK(0, 1) | GET_PREV_ALLOC(HDRP(bp)));
   } else {
-    return seg_listp + 12 * WSIZE;
+    put_new_node(bp, pad, GET_PREV_ALLOC(HDRP(bp)));
+    insert_node(bp);
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+  }
+
+  // the kernel keeps the page the new break falls in as it is, so clear
+  // its rest like the fresh pages above, and it is all pristine again
+  clear(bp + pad, PGROUNDUP(bp + pad) - (bp + pad));
+  mem_sbrk(-(int) (size - pad));
+  heap_clean = MIN(heap_clean, heap_end);
+  return 1;
+}
+
+int fit_index(size_t asize) {
+  if (asize <= 72) {
+    return small_class[(asize + 7) >> 3];
+  } else if (asize > 16392) {
+    return NUM_LISTS - 1;
   }
+  return log_table[(asize - 9) >> 6] + 4;
+}
+
+char *fit_list(size_t asize) {
+#ifdef DEBUG
+  printf("fit list: %d\n", fit_index(asize));
+#endif
+  return seg_listp + fit_index(asize) * WSIZE;
 }
 
 void remove_node(char *bp) {
-  char *first_node = fit_list(GET_SIZE(HDRP(bp)));
-  char *prev_bp = (char *) (uint64)GET(PREV_FREE(bp));
-  char *next_bp = (char *) (uint64)GET(NEXT_FREE(bp));
+  int index = fit_index(GET_SIZE(HDRP(bp)));
+#ifdef TREE
+  if (index == TREE_LIST) {
+    tree_remove(bp);
+    return;
+  }
+#endif
+  char *first_node = seg_listp + index * WSIZE;
+  char *prev_bp = GET_PTR(PREV_FREE(bp));
+  char *next_bp = GET_PTR(NEXT_FREE(bp));
 
 #ifdef RM
   printf("$rm: %p\n", bp);
@@ -416,15 +1097,16 @@ void remove_node(char *bp) {
 #endif
 
   if (prev_bp != 0) {
-    PUT(NEXT_FREE(prev_bp), (uint64)(next_bp));
+    PUT_PTR(NEXT_FREE(prev_bp), next_bp);
     if (next_bp != 0) {
-      PUT(PREV_FREE(next_bp), (uint64)(prev_bp));
+      PUT_PTR(PREV_FREE(next_bp), prev_bp);
     }
   } else if (next_bp != 0) {
-    PUT(first_node, (uint64)(next_bp));
+    PUT_PTR(first_node, next_bp);
     PUT(PREV_FREE(next_bp), 0);
   } else {
     PUT(first_node, 0);
+    CLR_MAP(index);
   }
 
 #ifdef DEBUG
@@ -433,12 +1115,23 @@ void remove_node(char *bp) {
 }
 
 void insert_node(char *bp) {
-  char *first_addr = fit_list(GET_SIZE(HDRP(bp)));
-  char *next_node = (char *) (uint64)GET(first_addr);
+  int index = fit_index(GET_SIZE(HDRP(bp)));
+#ifdef TREE
+  if (index == TREE_LIST) {
+    tree_insert(bp);
+    STAT(stats.walk++);
+    STAT(stat_walk(stats.insert_walk));
+    return;
+  }
+#endif
+  char *list = seg_listp + index * WSIZE;
+  char *first_addr = list;
+  char *next_node = GET_PTR(first_addr);
   // refactor: due to size constraint, we need to sort!
   // first_addr denotes the prev node, while next_node denotes the next node
 
-  for (; next_node != 0; next_node = (char *) (uint64)GET(NEXT_FREE(next_node))) {
+  for (; next_node != 0; next_node = GET_PTR(NEXT_FREE(next_node))) {
+    STAT(stats.walk++);
 #ifdef LAST
     printf("-------------------------------\n");
     printf("challenge size: %d\n", GET_SIZE(HDRP(bp)));
@@ -460,22 +1153,22 @@ void insert_node(char *bp) {
   printf("next_node: %p\n", next_node);
   printf("-------------------------------\n");
 #endif
-  if (first_addr != fit_list(GET_SIZE(HDRP(bp))) && first_addr != 0) {
+  if (first_addr != list && first_addr != 0) {
     if (next_node != 0) {
 #ifdef LXY
       printf("with some head\n");
 #endif
-      PUT(PREV_FREE(next_node), (uint64) bp);
-      PUT(NEXT_FREE(bp), (uint64) next_node);
-      PUT(PREV_FREE(bp), (uint64) first_addr);
-      PUT(NEXT_FREE(first_addr), (uint64) bp);
+      PUT_PTR(PREV_FREE(next_node), bp);
+      PUT_PTR(NEXT_FREE(bp), next_node);
+      PUT_PTR(PREV_FREE(bp), first_addr);
+      PUT_PTR(NEXT_FREE(first_addr), bp);
     } else {
 #ifdef LXY
       printf("without head\n");
 #endif
       PUT(NEXT_FREE(bp), 0);
-      PUT(PREV_FREE(bp), (uint64) first_addr);
-      PUT(NEXT_FREE(first_addr), (uint64) bp);
+      PUT_PTR(PREV_FREE(bp), first_addr);
+      PUT_PTR(NEXT_FREE(first_addr), bp);
     }
   } else {
     if (next_node != 0) {
@@ -483,37 +1176,513 @@ void insert_node(char *bp) {
       printf("with some head\n");
 #endif
 
-      PUT(PREV_FREE(next_node), (uint64) bp);
-      PUT(NEXT_FREE(bp), (uint64) next_node);
+      PUT_PTR(PREV_FREE(next_node), bp);
+      PUT_PTR(NEXT_FREE(bp), next_node);
       PUT(PREV_FREE(bp), 0);
-      PUT(first_addr, (uint64) bp);
+      PUT_PTR(first_addr, bp);
     } else {
 #ifdef LXY
       printf("without head\n");
 #endif
-      PUT(first_addr, (uint64) bp);
+      PUT_PTR(first_addr, bp);
       PUT(NEXT_FREE(bp), 0);
       PUT(PREV_FREE(bp), 0);
     }
   }
+  SET_MAP(index);
+  STAT(stat_walk(stats.insert_walk));
+}
+
+/*
+ * @brief top-down splay (Sleator & Tarjan) of the subtree rooted at t
+ * around the key (size, addr), returning the new root.
+ *
+ * if the key is absent, the new root is its predecessor or successor.
+ * instead of a dummy node, lhook/rhook point at the word where the next
+ * node of the left/right tree is to be hung, so no stack address ever
+ * gets stored into the heap.
+ */
+char *splay(char *t, size_t size, char *addr) {
+  uint lroot = 0, rroot = 0;
+  char *lhook = (char *) &lroot;
+  char *rhook = (char *) &rroot;
+  char *child;
+
+  while (1) {
+    if (KEY_LT(size, addr, GET_SIZE(HDRP(t)), t)) {
+      if ((child = NODE(LEFT(t))) == 0)
+        break;
+      if (KEY_LT(size, addr, GET_SIZE(HDRP(child)), child)) { /* rotate right */
+        PUT(LEFT(t), GET(RIGHT(child)));
+        PUT_PTR(RIGHT(child), t);
+        t = child;
+        if (NODE(LEFT(t)) == 0)
+          break;
+      }
+      PUT_PTR(rhook, t); /* link right */
+      rhook = LEFT(t);
+      t = NODE(LEFT(t));
+    } else if (KEY_LT(GET_SIZE(HDRP(t)), t, size, addr)) {
+      if ((child = NODE(RIGHT(t))) == 0)
+        break;
+      if (KEY_LT(GET_SIZE(HDRP(child)), child, size, addr)) { /* rotate left */
+        PUT(RIGHT(t), GET(LEFT(child)));
+        PUT_PTR(LEFT(child), t);
+        t = child;
+        if (NODE(RIGHT(t)) == 0)
+          break;
+      }
+      PUT_PTR(lhook, t); /* link left */
+      lhook = RIGHT(t);
+      t = NODE(RIGHT(t));
+    } else {
+      break;
+    }
+  }
+
+  PUT(lhook, GET(LEFT(t)));
+  PUT(rhook, GET(RIGHT(t)));
+  PUT(LEFT(t), lroot);
+  PUT(RIGHT(t), rroot);
+  return t;
+}
+
+/*
+ * @brief best fit in the tree: the smallest block of size >= asize,
+ * lowest address first among equal sizes.
+ */
+char *tree_fit(size_t asize) {
+  char *root = seg_listp + TREE_LIST * WSIZE;
+  char *t = splay(NODE(root), asize, 0);
+
+  PUT_PTR(root, t);
+  if (GET_SIZE(HDRP(t)) >= asize) {
+    return t;
+  }
+  // t is the predecessor, so the fit is the minimum of its right subtree
+  if (NODE(RIGHT(t)) == 0) {
+    return 0;
+  }
+  char *x = splay(NODE(RIGHT(t)), asize, 0);
+  PUT_PTR(RIGHT(t), x);
+  return x;
+}
+
+void tree_remove(char *bp) {
+  char *root = seg_listp + TREE_LIST * WSIZE;
+  char *t = splay(NODE(root), GET_SIZE(HDRP(bp)), bp);
+
+  if (NODE(LEFT(t)) == 0) {
+    PUT(root, GET(RIGHT(t)));
+  } else {
+    // every key on the left is smaller, so this lifts its maximum
+    char *x = splay(NODE(LEFT(t)), GET_SIZE(HDRP(bp)), bp);
+    PUT(RIGHT(x), GET(RIGHT(t)));
+    PUT_PTR(root, x);
+  }
+
+  if (GET(root) == 0) {
+    CLR_MAP(TREE_LIST);
+  }
+}
+
+void tree_insert(char *bp) {
+  char *root = seg_listp + TREE_LIST * WSIZE;
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (GET(root) == 0) {
+    PUT(LEFT(bp), 0);
+    PUT(RIGHT(bp), 0);
+  } else {
+    char *t = splay(NODE(root), size, bp);
+    if (KEY_LT(size, bp, GET_SIZE(HDRP(t)), t)) {
+      PUT(LEFT(bp), GET(LEFT(t)));
+      PUT_PTR(RIGHT(bp), t);
+      PUT(LEFT(t), 0);
+    } else {
+      PUT(RIGHT(bp), GET(RIGHT(t)));
+      PUT_PTR(LEFT(bp), t);
+      PUT(RIGHT(t), 0);
+    }
+  }
+
+  PUT_PTR(root, bp);
+  SET_MAP(TREE_LIST);
 }
 
+/*
+ * @brief grow the allocated block bp to asize bytes without moving it.
+ *
+ * this only works for the last block of the heap, optionally followed by
+ * one free block: the free block is absorbed and sbrk supplies exactly
+ * the missing delta, with the epilogue moved behind it. returns 0 and
+ * leaves the heap untouched when bp is not at the end or sbrk fails.
+ */
+void *grow_in_place(char *bp, size_t asize) {
+  size_t size = GET_SIZE(HDRP(bp));
+  char *next = NEXT_BLKP(bp);
+
+  if (!GET_ALLOC(HDRP(next))) {
+    if (GET_SIZE(HDRP(NEXT_BLKP(next))) != 0) {
+      return 0;
+    }
+    size += GET_SIZE(HDRP(next));
+  } else if (GET_SIZE(HDRP(next)) != 0) {
+    return 0;
+  }
+
+  if (asize - size > SBRK_MAX || (long) mem_sbrk(asize - size) == -1) {
+    return 0;
+  }
+#ifdef REALLOC
+  printf("grow_in_place: %p, %d -> %d\n", bp, size, asize);
+#endif
+  if (!GET_ALLOC(HDRP(next))) {
+    remove_node(next);
+  }
+  PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1) | PREV_ALLOC); /* New epilogue header */
+  TOUCH(HDRP(NEXT_BLKP(bp)));
+  return bp;
+}
+
+/*
+ * @brief allocate a block of at least size bytes whose bp is a multiple of
+ * alignment (a power of two, at least DSIZE).
+ *
+ * the leading slack in front of the aligned bp is split off as a free
+ * block, so it must be either empty or at least 2 * DSIZE bytes. if no
+ * free block can hold it, the heap is grown by exactly what is missing
+ * after its last free block.
+ */
+void *alloc_aligned(size_t alignment, size_t size) {
+  size_t asize = align(size);
+  char *bp, *abp;
+
+  if ((bp = find_aligned_fit(alignment, asize)) == 0) {
+    char *brk = heap_end;
+    char *start = GET_PREV_ALLOC(brk - WSIZE) ? brk : brk - GET_SIZE(brk - DSIZE);
+    long missing = aligned_bp(start, alignment) + asize - brk;
+    if (missing <= 0) {
+      bp = start;
+    } else if (missing > SBRK_MAX) {
+      return 0;
+    } else if ((bp = extend_heap(MAX(missing, 2 * DSIZE) / WSIZE)) == 0) {
+      return 0;
+    }
+  }
+
+  abp = aligned_bp(bp, alignment);
+
+  size_t csize = GET_SIZE(HDRP(bp));
+  remove_node(bp);
+  if (abp != bp) {
+    // bp was coalesced, so its previous block is allocated
+    put_new_node(bp, abp - bp, PREV_ALLOC);
+    insert_node(bp);
+    STAT(stats.splits++);
+    put_new_node(abp, csize - (abp - (char *) bp), 0);
+  }
+  place(abp, asize, 0);
+  return abp;
+}
+
+/*
+ * @brief the first multiple of alignment at or after bp that leaves either
+ * no slack in front or enough for a free block.
+ */
+char *aligned_bp(char *bp, size_t alignment) {
+  char *abp = (char *) (((uint64) bp + alignment - 1) & ~(uint64)(alignment - 1));
+
+  if (abp != bp && abp - bp < 2 * DSIZE) {
+    abp += alignment;
+  }
+  return abp;
+}
+
+/*
+ * @brief find a free block that holds asize bytes at a multiple of
+ * alignment.
+ *
+ * where an aligned bp falls depends on the block's address, so the sorted
+ * lists are walked block by block. the tree is only asked for a block
+ * that is large enough wherever it lies.
+ */
+char *find_aligned_fit(size_t alignment, size_t asize) {
+  uint map = GET_MAP() & (~0u << fit_index(asize));
+
+  while (map != 0) {
+    int index = LOWEST_BIT(map);
+#ifdef TREE
+    if (index == TREE_LIST) {
+      return tree_fit(asize + alignment + 2 * DSIZE);
+    }
+#endif
+    char *bp = NODE(seg_listp + index * WSIZE);
+    for (; bp != 0; bp = NODE(NEXT_FREE(bp))) {
+      if (aligned_bp(bp, alignment) + asize <= bp + GET_SIZE(HDRP(bp))) {
+        return bp;
+      }
+    }
+    map &= map - 1;
+  }
+  return 0;
+}
+
+int is_slab(void *ptr) {
+  uint64 page = ((uint64) ptr - (uint64) slab_base) / SLAB_SIZE;
+  return page < SLAB_MAP_WORDS * 32 && (slab_map[page >> 5] >> (page & 31)) & 1;
+}
+
+/*
+ * @brief take a free slot from a partial page of the size's class,
+ * carving a new page from the heap when there is none.
+ * returns 0 when no page could be made, or the class has not been asked
+ * for SLAB_WARMUP times yet, and the caller falls back to the segregated
+ * lists.
+ */
+void *slab_alloc(uint size) {
+  uint slot = ALIGN(size);
+  char *pg = slab_partial[slot / ALIGNMENT];
+
+  if (pg == 0) {
+    // a page costs SLAB_SIZE, so a class that is rarely used never gets one
+    if (slab_seen[slot / ALIGNMENT] < SLAB_WARMUP) {
+      slab_seen[slot / ALIGNMENT]++;
+      return 0;
+    }
+    if ((pg = alloc_aligned(SLAB_SIZE, SLAB_PAYLOAD)) == 0) {
+      return 0;
+    }
+    uint64 page = (pg - slab_base) / SLAB_SIZE;
+    if (page >= SLAB_MAP_WORDS * 32) {
+      free_block(pg);
+      return 0;
+    }
+    slab_map[page >> 5] |= 1u << (page & 31);
+
+    uint count = SLAB_COUNT(slot);
+    for (int i = 0; i < SLAB_WORDS; i++) {
+      uint bits = count >= 32 ? ~0u : (1u << count) - 1;
+      PUT(SLAB_BITS(pg) + i * WSIZE, bits);
+      count -= count >= 32 ? 32 : count;
+    }
+    PUT(SLAB_NEXT(pg), 0);
+    PUT(SLAB_PREV(pg), 0);
+    PUT(SLAB_SLOT(pg), slot);
+    PUT(SLAB_NFREE(pg), SLAB_COUNT(slot));
+    slab_partial[slot / ALIGNMENT] = pg;
+  }
+
+  char *word = SLAB_BITS(pg);
+  while (GET(word) == 0) {
+    word += WSIZE;
+  }
+  uint bits = GET(word);
+  int index = (word - SLAB_BITS(pg)) * 8 + LOWEST_BIT(bits);
+  PUT(word, bits & (bits - 1));
+
+  PUT(SLAB_NFREE(pg), GET(SLAB_NFREE(pg)) - 1);
+  if (GET(SLAB_NFREE(pg)) == 0) {
+    // full pages leave the partial list, pg is its head
+    char *next = GET_PTR(SLAB_NEXT(pg));
+    slab_partial[slot / ALIGNMENT] = next;
+    if (next != 0) {
+      PUT(SLAB_PREV(next), 0);
+    }
+  }
+
+  return pg + SLAB_HDR + index * slot;
+}
+
+/*
+ * @brief return a slot to its page. a page that becomes empty is given
+ * back to the segregated lists, unless it is the only partial page left
+ * in its class.
+ */
+void slab_free(void *ptr) {
+  char *pg = SLAB_PAGE(ptr);
+  uint slot = GET(SLAB_SLOT(pg));
+  uint nfree = GET(SLAB_NFREE(pg));
+  int index = ((char *) ptr - pg - SLAB_HDR) / slot;
+  char **head = &slab_partial[slot / ALIGNMENT];
+
+  PUT(SLAB_BITS(pg) + (index >> 5) * WSIZE,
+      GET(SLAB_BITS(pg) + (index >> 5) * WSIZE) | (1u << (index & 31)));
+  PUT(SLAB_NFREE(pg), ++nfree);
+
+  if (nfree == 1) {
+    // it was full, so it is not on the partial list yet
+    PUT(SLAB_PREV(pg), 0);
+    PUT_PTR(SLAB_NEXT(pg), *head);
+    if (*head != 0) {
+      PUT_PTR(SLAB_PREV(*head), pg);
+    }
+    *head = pg;
+  }
+
+  if (nfree == SLAB_COUNT(slot) && (*head != pg || GET(SLAB_NEXT(pg)) != 0)) {
+    char *prev = GET_PTR(SLAB_PREV(pg));
+    char *next = GET_PTR(SLAB_NEXT(pg));
+    if (prev != 0) {
+      PUT_PTR(SLAB_NEXT(prev), next);
+    } else {
+      *head = next;
+    }
+    if (next != 0) {
+      PUT_PTR(SLAB_PREV(next), prev);
+    }
+
+    uint64 page = (pg - slab_base) / SLAB_SIZE;
+    slab_map[page >> 5] &= ~(1u << (page & 31));
+    free_block(pg);
+  }
+}
+
+/*
+ * @brief really free every block cached on quick list index.
+ */
+void quick_flush(int index) {
+  char *bp = quick_list[index];
+
+  while (bp != 0) {
+    char *next = GET_PTR(bp);
+    free_block(bp);
+    bp = next;
+  }
+  quick_total -= quick_count[index];
+  quick_list[index] = 0;
+  quick_count[index] = 0;
+}
+
+/*
+ * @brief turn the allocated block bp into a free one and coalesce it.
+ */
+void free_block(char *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+
+  put_new_node(bp, size, GET_PREV_ALLOC(HDRP(bp)));
+  CLR_PREV_ALLOC(NEXT_BLKP(bp));
+  bp = coalesce(bp, 0, 0);
+
+  // trimming far below the threshold keeps free/malloc at the end from
+  // bouncing the break up and down
+  if (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0 && GET_SIZE(HDRP(bp)) > TRIM_THRESHOLD) {
+    trim_tail(bp, TRIM_KEEP);
+  }
+}
+
+/*
+ * @brief free the block bp, which is no slab slot: park it on its quick
+ * list, or really free it.
+ */
+void release_block(char *bp) {
+#ifdef QUICK
+  size_t size = GET_SIZE(HDRP(bp));
+  if (size <= QUICK_MAX) {
+    int index = size / DSIZE;
+    PUT_PTR(bp, quick_list[index]);
+    quick_list[index] = bp;
+    quick_total++;
+    if (++quick_count[index] > QUICK_LIMIT) {
+      quick_flush(index);
+    }
+    return;
+  }
+#endif
+  free_block(bp);
+}
+
+/*
+ * @brief sort n pointers by address (shell sort, gaps 1, 4, 13, 40, ...).
+ */
+void sort_ptrs(void **ptrs, int n) {
+  int gap = 1;
+
+  while (gap < n / 3) {
+    gap = gap * 3 + 1;
+  }
+  for (; gap > 0; gap /= 3) {
+    for (int i = gap; i < n; i++) {
+      void *p = ptrs[i];
+      int j = i;
+      for (; j >= gap && (char *) ptrs[j - gap] > (char *) p; j -= gap) {
+        ptrs[j] = ptrs[j - gap];
+      }
+      ptrs[j] = p;
+    }
+  }
+}
+
+/*
+ * @brief zero bytes bytes at p, which is 8-byte aligned, a word at a time.
+ */
+void clear(char *p, size_t bytes) {
+  uint64 *w = (uint64 *) p;
+
+  for (; bytes >= sizeof(uint64); bytes -= sizeof(uint64)) {
+    *w++ = 0;
+  }
+  for (p = (char *) w; bytes > 0; bytes--) {
+    *p++ = 0;
+  }
+}
+
+/*
+ * @brief rewrite the size and alloc bit of bp, keeping its pa bit, and
+ * let the next block know about it
+ */
 void put_old_node(char *bp, size_t size, int alloc) {
-  PUT(HDRP(bp), PACK(size, alloc));
-  PUT(FTRP(bp), PACK(size, alloc));
+  PUT(HDRP(bp), PACK(size, alloc) | GET_PREV_ALLOC(HDRP(bp)));
+  if (alloc) {
+    SET_PREV_ALLOC(NEXT_BLKP(bp));
+  } else {
+    PUT(FTRP(bp), PACK(size, 0));
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
+  }
 }
 
-void put_new_node(char *bp, size_t size, int alloc) {
-  PUT(HDRP(bp), PACK(size, alloc));
-  PUT(FTRP(bp), PACK(size, alloc));
+/*
+ * @brief write a fresh free block with empty links; prev_alloc is the
+ * pa bit (PREV_ALLOC or 0) to give its header
+ */
+void put_new_node(char *bp, size_t size, int prev_alloc) {
+  PUT(HDRP(bp), PACK(size, 0) | prev_alloc);
+  PUT(FTRP(bp), PACK(size, 0));
   PUT(NEXT_FREE(bp), 0);
   PUT(PREV_FREE(bp), 0);
 }
 
+/* header plus payload, rounded up to DSIZE and at least a free block */
 size_t align(size_t size) {
-  if (size <= DSIZE) {
+  if (size <= DSIZE + WSIZE) {
     return 2 * DSIZE;
   } else {
-    return DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+    return DSIZE * ((size + (WSIZE) + (DSIZE - 1)) / DSIZE);
   }
 }
+
+#ifdef STATS
+/*
+ * @brief add delta to the bytes the caller holds, keeping the peak.
+ */
+void stat_add(int delta) {
+  stats.allocated += delta;
+  if (stats.allocated > stats.peak) {
+    stats.peak = stats.allocated;
+  }
+}
+
+/*
+ * @brief file the walk of the search that just ended into hist.
+ */
+void stat_walk(uint *hist) {
+  int i = 0;
+
+  while (i < WALK_BUCKETS - 1 && (stats.walk >> i) != 0) {
+    i++;
+  }
+  hist[i]++;
+  stats.walk = 0;
+}
+#endif
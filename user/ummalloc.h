@@ -2,3 +2,17 @@ extern int mm_init(void);
 extern void *mm_malloc(uint size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, uint size);
+extern int mm_trim(uint pad);
+extern int mm_malloc_batch(uint size, int n, void **out);
+extern void mm_free_batch(void **ptrs, int n);
+extern void *mm_calloc(uint n, uint size);
+extern void *mm_memalign(uint alignment, uint size);
+extern void *mm_aligned_alloc(uint alignment, uint size);
+// mm_free for a caller that knows the size it asked for. the block may be
+// larger than that (realloc keeps a block at least half full, splits
+// leave slivers, grown and batch blocks carry slack), so size never
+// stands in for the header: it only skips the slab lookup when it is too
+// big for a slab slot.
+extern void mm_free_sized(void *ptr, uint size);
+extern uint mm_usable_size(void *ptr);
+extern void mm_stats(void);
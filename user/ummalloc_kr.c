@@ -0,0 +1,61 @@
+#include "kernel/types.h"
+#include "user/user.h"
+#include "ummalloc.h"
+
+/*
+ * the K&R allocator of umalloc.c behind the mm_* interface, so that
+ * ummalloc_test can replay traces against it as one more engine.
+ * the Makefile links it with a private copy of umalloc.o, whose free list
+ * can't be reset: every run of an engine starts in a fresh child anyway.
+ */
+
+#ifdef MTRACE
+/* the allocator itself, not the recording wrappers around it */
+void *kr_malloc(uint);
+void kr_free(void *);
+#define malloc kr_malloc
+#define free kr_free
+#endif
+
+/* the block header of umalloc.c; sizes are counted in headers */
+typedef long Align;
+
+union header {
+  struct {
+    union header *ptr;
+    uint size;
+  } s;
+  Align x;
+};
+
+typedef union header Header;
+
+int mm_init(void) { return 0; }
+
+void *mm_malloc(uint size) { return malloc(size); }
+
+void mm_free(void *ptr) { free(ptr); }
+
+/*
+ * mm_realloc - K&R has none: keep the block if it is big enough,
+ *     otherwise move it
+ */
+void *mm_realloc(void *ptr, uint size) {
+  void *newptr;
+  uint copySize;
+
+  if (ptr == 0) {
+    return malloc(size);
+  } else if (size == 0) {
+    free(ptr);
+    return 0;
+  }
+
+  copySize = (((Header *)ptr - 1)->s.size - 1) * sizeof(Header);
+  if (size <= copySize) return ptr;
+  newptr = malloc(size);
+  if (newptr == 0) return 0;
+  memcpy(newptr, ptr, copySize);
+  free(ptr);
+  return newptr;
+}
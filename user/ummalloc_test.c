@@ -2,14 +2,149 @@
 
 //#define DEBUG
 #include "kernel/fcntl.h"
-#include "ummalloc.h"
 #include "user/user.h"
-typedef enum { ALLOC, FREE, REALLOC } op_t;
+#include "user/trace.h"
+
+// one parsed trace line; arg is n for A/F/c and align for m
+struct trace_op {
+  op_t op;
+  int id;
+  int size;
+  int arg;
+};
+
+// -t: time a bare replay of the mm_* calls instead of the checked run
+int alloc_only;
+// -n: runs per trace, the times are summarised over them
+#define MAX_RUNS 32
+int runs = 1;
+// -c: every SAMPLE_EVERY ops of the checked run, log heap extent and live bytes
+#define SAMPLE_EVERY 64
+int csv_fd = -1;
+// every TRIM_EVERY ops of a checked run of its own, an engine with mm_trim trims
+#define TRIM_EVERY 1024
+// -a: every engine on every trace, reported as one table at the end
+int all_engines;
+
+/*
+ * the score weighs the mean utilization against the throughput over all
+ * traces, as in CS:APP. THRU_REF (milli-ops per mtime tick) or more earns
+ * the full throughput share: 200 is an op per 500 ns of qemu's 10 MHz
+ * mtime. it only makes sense for -t times.
+ */
+#define UTIL_WEIGHT 60
+#define THRU_REF 200
+
+/*
+ * the allocators to test. the Makefile links each one in with its mm_*
+ * entry points renamed to <engine>_mm_*, all its other symbols made local
+ * and its sbrk calls sent to engine_sbrk. entry points an engine lacks are
+ * weak, so they come out null: batches then fall back to single calls, sized
+ * frees to mm_free, aligned allocs to mm_memalign, calloc to mm_malloc
+ * and a memset, traces that use memalign are skipped and so is the run
+ * that checks mm_trim.
+ */
+struct engine {
+  char* name;
+  int (*init)(void);
+  void* (*malloc)(uint);
+  void (*free)(void*);
+  void* (*realloc)(void*, uint);
+  int (*malloc_batch)(uint, int, void**);
+  void (*free_batch)(void**, int);
+  void* (*memalign)(uint, uint);
+  void* (*aligned_alloc)(uint, uint);
+  void* (*calloc)(uint, uint);
+  void (*free_sized)(void*, uint);
+  uint (*usable_size)(void*);
+  int (*trim)(uint);
+  void (*stats)(void);
+};
+
+#define ENGINE_API(e)                                               \
+  int e##_mm_init(void);                                            \
+  void* e##_mm_malloc(uint);                                        \
+  void e##_mm_free(void*);                                          \
+  void* e##_mm_realloc(void*, uint);                                \
+  int e##_mm_malloc_batch(uint, int, void**) __attribute__((weak)); \
+  void e##_mm_free_batch(void**, int) __attribute__((weak));        \
+  void* e##_mm_memalign(uint, uint) __attribute__((weak));          \
+  void* e##_mm_aligned_alloc(uint, uint) __attribute__((weak));     \
+  void* e##_mm_calloc(uint, uint) __attribute__((weak));            \
+  void e##_mm_free_sized(void*, uint) __attribute__((weak));        \
+  uint e##_mm_usable_size(void*) __attribute__((weak));             \
+  int e##_mm_trim(uint) __attribute__((weak));                      \
+  void e##_mm_stats(void) __attribute__((weak));
+#define ENGINE(e)                                                   \
+  { #e, e##_mm_init, e##_mm_malloc, e##_mm_free, e##_mm_realloc,    \
+    e##_mm_malloc_batch, e##_mm_free_batch, e##_mm_memalign,        \
+    e##_mm_aligned_alloc, e##_mm_calloc, e##_mm_free_sized, e##_mm_usable_size,           \
+    e##_mm_trim, e##_mm_stats }
+
+ENGINE_API(ummalloc)
+ENGINE_API(tlsf)
+ENGINE_API(great)
+ENGINE_API(naive)
+ENGINE_API(stupid)
+ENGINE_API(kr)
+
+struct engine engines[] = {ENGINE(ummalloc), ENGINE(tlsf), ENGINE(great),
+                           ENGINE(naive), ENGINE(stupid), ENGINE(kr)};
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+// -e: the engine under test
+struct engine* eng = engines;
+
+// a .bin trace is streamed from its file CHUNK_OPS ops at a time
+#define CHUNK_OPS 1024
+
+struct trace {
+  char* name;
+  int num_ids;
+  int num_ops;
+  int memalign;  // any m op in it
+  int bin;  // streamed, only a chunk of it is in ops at a time
+  struct trace_op* ops;
+  struct trace_rec* recs;  // the chunk as read, for a .bin trace
+  int fd;
+};
+
+// what one run, in its own child, reports back
+struct run {
+  uint ticks;
+  uint live;  // most bytes live at once
+  uint heap;  // highest break, from the start of the heap
+  uint final;  // break at the end
+  uint sbrk_calls;
+};
+
+struct result {
+  int ok;  // 1 ran, 0 failed, -1 skipped
+  uint util;  // peak live bytes per mille of the peak heap extent
+  uint heap;
+  uint ops;
+  uint ticks;  // median over the runs
+};
+
+struct sample {
+  int op;
+  uint heap;
+  uint live;
+};
+
+// the trace is read a block per syscall, not a byte
+char rbuf[512];
+int rbuf_pos, rbuf_len;
 
 char fgetc(int fd) {
-  char ret;
-  read(fd, &ret, sizeof(char));
-  return ret;
+  if (rbuf_pos == rbuf_len) {
+    rbuf_len = read(fd, rbuf, sizeof(rbuf));
+    rbuf_pos = 0;
+    if (rbuf_len <= 0) {
+      rbuf_len = 0;
+      return 0;
+    }
+  }
+  return rbuf[rbuf_pos++];
 }
 
 int fgetint(int fd) {
@@ -33,6 +168,16 @@ op_t fgetop(int fd) {
         return FREE;
       case 'r':
         return REALLOC;
+      case 'A':
+        return BALLOC;
+      case 'F':
+        return BFREE;
+      case 'm':
+        return MEMALIGN;
+      case 's':
+        return FREE_SIZED;
+      case 'c':
+        return CALLOC;
       default:
         c = fgetc(fd);
     }
@@ -49,25 +194,83 @@ void lib_err(char* msg) {
   exit(3);
 }
 
+/*
+ * live ranges, kept in a treap ordered by lo so that an overlap check or a
+ * removal only walks one path. the ranges never overlap, so a new range
+ * only has to be checked against the one starting right before its end.
+ * split and merge hang nodes on hooks instead of recursing, as the stack
+ * of a user program is a single page.
+ */
 struct range_t {
   void* lo;
   void* hi;
-  struct range_t* nxt;
+  uint prio;
+  struct range_t* l;
+  struct range_t* r;
 };
 
-struct range_t* range_head;
+struct range_t* range_root;
 struct range_t* range_spc;
 struct range_t* range_free_head;
+uint range_seed;
 void* begin_heap_top;
 
+void reset_range(int num_ids) {
+  range_root = 0;
+  range_free_head = 0;
+  for (int i = 0; i < num_ids; ++i) {
+    range_spc[i].l = range_free_head;
+    range_free_head = range_spc + i;
+  }
+  range_seed = 2463534242;
+}
+
 void init_range(int num_ids) {
-  range_spc = malloc((num_ids + 1) * sizeof(struct range_t));
-  range_head = range_spc;
-  range_head->nxt = 0;
-  range_free_head = range_spc + 1;
-  for (int i = 1; i < num_ids; ++i) {
-    range_spc[i].nxt = range_spc + i + 1;
+  range_spc = malloc(num_ids * sizeof(struct range_t));
+  reset_range(num_ids);
+}
+
+// xorshift32
+uint range_prio() {
+  range_seed ^= range_seed << 13;
+  range_seed ^= range_seed >> 17;
+  range_seed ^= range_seed << 5;
+  return range_seed;
+}
+
+// split t into the ranges below lo (*l) and the rest (*r)
+void range_split(struct range_t* t, void* lo, struct range_t** l, struct range_t** r) {
+  while (t) {
+    if (t->lo < lo) {
+      *l = t;
+      l = &t->r;
+      t = t->r;
+    } else {
+      *r = t;
+      r = &t->l;
+      t = t->l;
+    }
   }
+  *l = *r = 0;
+}
+
+// join two treaps, every range of a lying below every range of b
+struct range_t* range_merge(struct range_t* a, struct range_t* b) {
+  struct range_t* root;
+  struct range_t** hook = &root;
+  while (a && b) {
+    if (a->prio > b->prio) {
+      *hook = a;
+      hook = &a->r;
+      a = a->r;
+    } else {
+      *hook = b;
+      hook = &b->l;
+      b = b->l;
+    }
+  }
+  *hook = a ? a : b;
+  return root;
 }
 
 void add_range(void* lo, uint size) {
@@ -79,72 +282,353 @@ void add_range(void* lo, uint size) {
     lib_err("alloc not in heap");
   }
   // Check vaild
-  struct range_t* curr;
-  for (curr = range_head; curr->nxt; curr = curr->nxt) {
-//#ifdef DEBUG
-//    printf("curr->nxt->lo: %p, curr->nxt->hi: %p\n", curr->nxt->lo, curr->nxt->hi);
-//#endif
-    if (!(hi <= curr->nxt->lo || curr->nxt->hi <= lo)) lib_err("alloc conflict");
+  struct range_t* below = 0;
+  for (struct range_t* t = range_root; t;) {
+    if (t->lo < hi) {
+      below = t;
+      t = t->r;
+    } else {
+      t = t->l;
+    }
   }
+  if (below && below->hi > lo) lib_err("alloc conflict");
 
-  // Add into linked list
+  // Add into the treap, under the first node of lower priority
   struct range_t* new = range_free_head;
-  range_free_head = new->nxt;
-  curr->nxt = new;
+  range_free_head = new->l;
   new->lo = lo;
   new->hi = hi;
-  new->nxt = 0;
+  new->prio = range_prio();
+  struct range_t** link = &range_root;
+  while (*link && (*link)->prio > new->prio) {
+    link = lo < (*link)->lo ? &(*link)->l : &(*link)->r;
+  }
+  range_split(*link, lo, &new->l, &new->r);
+  *link = new;
 }
 
 void rm_range(void* lo) {
-  struct range_t* curr;
-  for (curr = range_head; curr->nxt; curr = curr->nxt) {
-    if (curr->nxt->lo == lo) break;
+  struct range_t** link = &range_root;
+  while (*link && (*link)->lo != lo) {
+    link = lo < (*link)->lo ? &(*link)->l : &(*link)->r;
   }
-  struct range_t* rm = curr->nxt;
+  struct range_t* rm = *link;
   if (rm == 0) sys_err("range to free not found");
 #ifdef DEBUG
   printf("rm->lo: %p\n", rm->lo);
   printf("rm->hi: %p\n", rm->hi);
 #endif
-  curr->nxt = rm->nxt;
-  rm->nxt = range_free_head;
+  *link = range_merge(rm->l, rm->r);
+  rm->l = range_free_head;
   range_free_head = rm;
 }
 
-void memcheck(void* mem, int ch, uint size) {
+void memcheck(void* mem, int ch, uint size, char* msg) {
   char* curr = (char*)mem;
   int i;
   for (i = 0; i < size; i++) {
-    if (*curr != (char)ch) lib_err("realloc: data not preserved");
+    if (*curr != (char)ch) lib_err(msg);
     curr++;
   }
 }
 
-void run_test(char *filename) {
+/*
+ * a .rep trace is read whole into memory, so that no syscall is timed. of a
+ * .bin trace, told apart by its magic, only the header is read here: the
+ * runs stream it with trace_ops, so it may hold far more ops than would fit.
+ */
+void load_trace(char *filename, struct trace* t) {
+  struct trace_hdr hdr;
   int fd = open(filename, O_RDONLY);
   if (fd == -1) sys_err("open trace fail");
-  int num_ids = fgetint(fd);
-  int num_ops = fgetint(fd);
-  void** ptr = malloc(num_ids * sizeof(void*));
-  int* ptr_size = malloc(num_ids * sizeof(int));
-  init_range(num_ids);
+  t->name = filename;
+  t->fd = -1;
+  int n = read(fd, &hdr, sizeof(hdr));
+  if (n == sizeof(hdr) && hdr.magic == TRACE_MAGIC) {
+    t->bin = 1;
+    t->num_ids = hdr.num_ids;
+    t->num_ops = hdr.num_ops;
+    t->memalign = hdr.flags & TRACE_MEMALIGN;
+    t->ops = malloc(CHUNK_OPS * sizeof(struct trace_op));
+    t->recs = malloc(CHUNK_OPS * sizeof(struct trace_rec));
+    close(fd);
+    return;
+  }
+  // text: the bytes taken for a header are the start of it
+  t->bin = 0;
+  memmove(rbuf, &hdr, n > 0 ? n : 0);
+  rbuf_pos = 0;
+  rbuf_len = n > 0 ? n : 0;
+  t->num_ids = fgetint(fd);
+  t->num_ops = fgetint(fd);
+  t->memalign = 0;
+  struct trace_op* ops = t->ops = malloc(t->num_ops * sizeof(struct trace_op));
+  for (int i = 0; i < t->num_ops; ++i) {
+    struct trace_op* o = ops + i;
+    o->op = fgetop(fd);
+    o->id = fgetint(fd);
+    o->size = o->arg = 0;
+    switch (o->op) {
+      case ALLOC:
+      case REALLOC:
+      case FREE_SIZED:
+        o->size = fgetint(fd);
+        break;
+      case FREE:
+        break;
+      case BALLOC:
+        o->size = fgetint(fd);
+        o->arg = fgetint(fd);
+        break;
+      case BFREE:
+        o->arg = fgetint(fd);
+        break;
+      case CALLOC:
+        o->arg = fgetint(fd);
+        o->size = fgetint(fd);
+        break;
+      case MEMALIGN:
+        o->arg = fgetint(fd);
+        o->size = fgetint(fd);
+        t->memalign = 1;
+        break;
+    }
+  }
+  close(fd);
+}
+
+// start a run of t from its first op
+void rewind_trace(struct trace* t) {
+  if (!t->bin) return;
+  struct trace_hdr hdr;
+  if (t->fd >= 0) close(t->fd);
+  t->fd = open(t->name, O_RDONLY);
+  if (t->fd == -1 || read(t->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) sys_err("open trace fail");
+}
+
+/*
+ * the ops of t from op i on that are in memory, *n of them: all the rest
+ * of a .rep trace, the next chunk of a .bin one. the chunk is read and
+ * unpacked here, so callers stop their clock around this.
+ */
+struct trace_op* trace_ops(struct trace* t, int i, int* n) {
+  *n = t->num_ops - i;
+  if (!t->bin) return t->ops + i;
+  if (*n > CHUNK_OPS) *n = CHUNK_OPS;
+  int bytes = *n * sizeof(struct trace_rec);
+  if (read(t->fd, t->recs, bytes) != bytes) sys_err("trace ends early");
+  for (int j = 0; j < *n; ++j) {
+    struct trace_op* o = t->ops + j;
+    uint head = t->recs[j].head;
+    o->op = REC_OP(head);
+    o->id = REC_ID(head);
+    o->size = t->recs[j].size;
+    o->arg = o->op == MEMALIGN ? 1 << REC_ARG(head) : REC_ARG(head);
+  }
+  return t->ops;
+}
+
+#define PGSIZE 4096
+
+// every engine sbrk comes here, so the harness sees each move of the break
+uint sbrk_calls;
+void* heap_top;
+void* peak_heap_top;
+
+char* engine_sbrk(int n) {
+  char* old = sbrk(n);
+  sbrk_calls++;
+  if (old != (char*)-1) {
+    heap_top = old + n;
+    if (peak_heap_top < heap_top) peak_heap_top = heap_top;
+  }
+  return old;
+}
+
+/*
+ * start the engine on a heap that begins at the next page boundary, so
+ * that where the harness left the break can't change the numbers: they
+ * are the same in the guest and in the native build.
+ */
+void engine_init() {
+  uint64 top = (uint64)sbrk(0);
+  if (top % PGSIZE) sbrk(PGSIZE - top % PGSIZE);
+  begin_heap_top = heap_top = peak_heap_top = sbrk(0);
+  sbrk_calls = 0;
+  if (eng->init() == -1) lib_err("mm_init");
+}
+
+int malloc_batch(uint size, int n, void** out) {
+  if (eng->malloc_batch) return eng->malloc_batch(size, n, out);
+  for (int i = 0; i < n; ++i) {
+    if ((out[i] = eng->malloc(size)) == 0) return i;
+  }
+  return n;
+}
+
+void free_batch(void** ptrs, int n) {
+  if (eng->free_batch) {
+    eng->free_batch(ptrs, n);
+    return;
+  }
+  for (int i = 0; i < n; ++i) eng->free(ptrs[i]);
+}
+
+// an m op whose size is a multiple of its alignment is an aligned_alloc
+void* engine_memalign(uint align, uint size) {
+  if (eng->aligned_alloc && size % align == 0) return eng->aligned_alloc(align, size);
+  return eng->memalign(align, size);
+}
+
+void* engine_calloc(uint n, uint size) {
+  if (eng->calloc) return eng->calloc(n, size);
+  void* p = eng->malloc(n * size);
+  if (p) memset(p, 0, n * size);
+  return p;
+}
+
+void free_sized(void* ptr, uint size) {
+  if (eng->free_sized) {
+    eng->free_sized(ptr, size);
+    return;
+  }
+  eng->free(ptr);
+}
+
+// the mm_* calls of the trace and nothing else, for timing
+void replay(struct trace* t, struct run* out) {
+  void** ptr = malloc(t->num_ids * sizeof(void*));
+  void** batch = malloc(t->num_ids * sizeof(void*));
+  rewind_trace(t);
+  uint begin_clk = getclk();
+  engine_init();
+  out->ticks = getclk() - begin_clk;
+  for (int i = 0, n; i < t->num_ops; i += n) {
+    struct trace_op* ops = trace_ops(t, i, &n);
+    begin_clk = getclk();
+    for (struct trace_op* o = ops; o < ops + n; ++o) {
+      switch (o->op) {
+        case ALLOC:
+          ptr[o->id] = eng->malloc(o->size);
+          break;
+        case FREE:
+          eng->free(ptr[o->id]);
+          break;
+        case REALLOC:
+          ptr[o->id] = eng->realloc(ptr[o->id], o->size);
+          break;
+        case BALLOC:
+          malloc_batch(o->size, o->arg, ptr + o->id);
+          break;
+        case BFREE:
+          memmove(batch, ptr + o->id, o->arg * sizeof(void*));
+          free_batch(batch, o->arg);
+          break;
+        case MEMALIGN:
+          ptr[o->id] = engine_memalign(o->arg, o->size);
+          break;
+        case FREE_SIZED:
+          free_sized(ptr[o->id], o->size);
+          break;
+        case CALLOC:
+          ptr[o->id] = engine_calloc(o->arg, o->size);
+          break;
+      }
+    }
+    out->ticks += getclk() - begin_clk;
+  }
+}
+
+// what a block is filled with before it is freed
+#define JUNK 0xA5
+
+/*
+ * fill the block at p, of size bytes, with JUNK before it is freed, up to
+ * its usable size if the engine reports one: calloc then gets dirty blocks
+ * to reuse, and an overstated usable size clobbers the next block.
+ */
+void scribble(void* p, uint size) {
+  uint usable = eng->usable_size ? eng->usable_size(p) : size;
+  if (usable < size) lib_err("mm_usable_size: smaller than asked for");
+  memset(p, JUNK, usable);
+}
+
+/*
+ * stamp every live block, those with a size in ptr_size, have the engine
+ * give back all the free memory at the end of its heap, and check that the
+ * break only went down, and went down just when mm_trim says it did, and
+ * that the blocks are still below it, as big as they were and intact.
+ */
+void trim_check(void** ptr, int* ptr_size, int num_ids) {
+  for (int id = 0; id < num_ids; ++id) {
+    if (ptr_size[id]) memset(ptr[id], id & 0xFF, ptr_size[id]);
+  }
+  void* before = heap_top;
+  int shrank = eng->trim(0);
+  if (heap_top > before) lib_err("mm_trim: heap grew");
+  if ((shrank != 0) != (heap_top < before)) lib_err("mm_trim: wrong result");
+  for (int id = 0; id < num_ids; ++id) {
+    if (ptr_size[id] == 0) continue;
+    if ((char*)ptr[id] + ptr_size[id] > (char*)heap_top) lib_err("mm_trim: block above the break");
+    if (eng->usable_size && eng->usable_size(ptr[id]) < ptr_size[id]) lib_err("mm_trim: block shrank");
+    memcheck(ptr[id], id & 0xFF, ptr_size[id], "mm_trim: data not preserved");
+  }
+}
+
+void write_samples(struct trace* t, struct sample* samples, int num_samples) {
+  for (int i = 0; i < num_samples; ++i) {
+    fprintf(csv_fd, "%s,%s,%d,%d,%d\n", eng->name, t->name, samples[i].op, samples[i].heap, samples[i].live);
+  }
+}
+
+/*
+ * run the trace checking every result. if sample is set and there is a
+ * csv file, heap extent and live bytes go to it every SAMPLE_EVERY ops and
+ * after the last one, while the clock is stopped for the next chunk. if
+ * trim is set, trim_check runs every TRIM_EVERY ops but the last, with the
+ * clock stopped too: it moves the break, so such runs are not the ones
+ * whose heap counts.
+ */
+void check_run(struct trace* t, int sample, int trim, struct run* out) {
+  struct trace_op* ops = 0;
+  int num_ops = t->num_ops;
+  int base = 0, end = 0;  // ops holds the ops from base to end
+  void** ptr = malloc(t->num_ids * sizeof(void*));
+  int* ptr_size = malloc(t->num_ids * sizeof(int));
+  memset(ptr_size, 0, t->num_ids * sizeof(int));
+  void** batch = malloc(t->num_ids * sizeof(void*));
+  struct sample* samples = 0;
+  int num_samples = 0;
+  if (sample && csv_fd >= 0) {
+    samples = malloc(((t->bin ? CHUNK_OPS : num_ops) / SAMPLE_EVERY + 2) * sizeof(struct sample));
+  }
+  init_range(t->num_ids);
+  rewind_trace(t);
   int max_total_size = 0;
   int total_size = 0;
   uint begin_clk = getclk();
-  begin_heap_top = sbrk(0);
-  if (mm_init() == -1) lib_err("mm_init");
+  engine_init();
+  out->ticks = 0;
   for (int i = 0; i < num_ops; ++i) {
-    op_t op = fgetop(fd);
-    int id, size;
-    switch (op) {
+    if (i == end) {
+      out->ticks += getclk() - begin_clk;
+      write_samples(t, samples, num_samples);
+      num_samples = 0;
+      int len;
+      ops = trace_ops(t, i, &len);
+      base = i;
+      end = i + len;
+      begin_clk = getclk();
+    }
+    struct trace_op* o = ops + (i - base);
+    int id = o->id, size = o->size;
+    int n = o->arg, align = o->arg;
+    switch (o->op) {
       case ALLOC:
-        id = fgetint(fd);
-        size = fgetint(fd);
 #ifdef DEBUG
         printf("## malloc id: %d, size: %d\n", id, size);
 #endif
-        ptr[id] = mm_malloc(size);
+        ptr[id] = eng->malloc(size);
 #ifdef DEBUG
         printf("&& ptr[%d]: %p\n", id, ptr[id]);
         printf("**heap top: %d\n", sbrk(0));
@@ -155,57 +639,356 @@ void run_test(char *filename) {
         total_size += size;
         break;
       case FREE:
-        id = fgetint(fd);
-        mm_free(ptr[id]);
+        scribble(ptr[id], ptr_size[id]);
+        eng->free(ptr[id]);
 #ifdef DEBUG
         printf("## freeing id: %d\n", id);
 #endif
         if (ptr_size[id]) rm_range(ptr[id]);
         total_size -= ptr_size[id];
+        ptr_size[id] = 0;
         break;
-      case REALLOC:
-        id = fgetint(fd);
-        size = fgetint(fd);
+      case REALLOC: {
         void* old_ptr = ptr[id];
         uint min_size = size < ptr_size[id] ? size : ptr_size[id];
         memset(old_ptr, i & 0xFF, min_size);
 #ifdef DEBUG
         printf("## realloc id: %d, size: %d\n", id, size);
 #endif
-        ptr[id] = mm_realloc(old_ptr, size);
+        ptr[id] = eng->realloc(old_ptr, size);
         if (size && ptr[id] == 0) {
           printf("heap used : %d bytes\n", (void*)sbrk(0) - begin_heap_top);
           lib_err("realloc");
         }
-        memcheck(ptr[id], i & 0xFF, min_size);
+        memcheck(ptr[id], i & 0xFF, min_size, "realloc: data not preserved");
         total_size += size - ptr_size[id];
         if (ptr_size[id]) rm_range(old_ptr);
         if (size) add_range(ptr[id], size);
         ptr_size[id] = size;
         break;
+      }
+      case BALLOC:  // A id size n: ids id .. id + n - 1 in one call
+#ifdef DEBUG
+        printf("## malloc_batch id: %d, size: %d, n: %d\n", id, size, n);
+#endif
+        if (malloc_batch(size, n, ptr + id) != n) lib_err("mm_malloc_batch");
+        for (int j = id; j < id + n; ++j) {
+          add_range(ptr[j], size);
+          ptr_size[j] = size;
+        }
+        total_size += size * n;
+        break;
+      case BFREE:  // F id n: ids id .. id + n - 1 in one call
+#ifdef DEBUG
+        printf("## freeing batch id: %d, n: %d\n", id, n);
+#endif
+        for (int j = id; j < id + n; ++j) {
+          if (ptr_size[j]) rm_range(ptr[j]);
+          total_size -= ptr_size[j];
+          scribble(ptr[j], ptr_size[j]);
+          batch[j - id] = ptr[j];
+          ptr_size[j] = 0;
+        }
+        // the batch gets sorted, so it can't be ptr itself
+        free_batch(batch, n);
+        break;
+      case MEMALIGN:  // m id align size
+#ifdef DEBUG
+        printf("## memalign id: %d, align: %d, size: %d\n", id, align, size);
+#endif
+        if (eng->aligned_alloc && size % align && eng->aligned_alloc(align, size)) {
+          lib_err("mm_aligned_alloc: size not a multiple of the alignment");
+        }
+        ptr[id] = engine_memalign(align, size);
+        if (ptr[id] == 0) lib_err("mm_memalign");
+        if ((uint64)ptr[id] % align) lib_err("mm_memalign: misaligned");
+        if (size) add_range(ptr[id], size);
+        ptr_size[id] = size;
+        total_size += size;
+        break;
+      case FREE_SIZED:  // s id size
+#ifdef DEBUG
+        printf("## freeing id: %d, size: %d\n", id, size);
+#endif
+        if (size != ptr_size[id]) sys_err("free_sized: not the size id was given");
+        scribble(ptr[id], size);
+        free_sized(ptr[id], size);
+        if (size) rm_range(ptr[id]);
+        total_size -= size;
+        ptr_size[id] = 0;
+        break;
+      case CALLOC:  // c id n size
+#ifdef DEBUG
+        printf("## calloc id: %d, n: %d, size: %d\n", id, n, size);
+#endif
+        ptr[id] = engine_calloc(n, size);
+        if (ptr[id] == 0) lib_err("mm_calloc");
+        memcheck(ptr[id], 0, n * size, "mm_calloc: not zeroed");
+        add_range(ptr[id], n * size);
+        ptr_size[id] = n * size;
+        total_size += n * size;
+        break;
     }
     if (max_total_size < total_size) max_total_size = total_size;
+    if (samples && (i % SAMPLE_EVERY == 0 || i == num_ops - 1)) {
+      samples[num_samples].op = i;
+      samples[num_samples].heap = heap_top - begin_heap_top;
+      samples[num_samples].live = total_size;
+      num_samples++;
+    }
+    if (trim && i % TRIM_EVERY == TRIM_EVERY - 1 && i != num_ops - 1) {
+      out->ticks += getclk() - begin_clk;
+      trim_check(ptr, ptr_size, t->num_ids);
+      begin_clk = getclk();
+    }
 //    printf("cur heap top: %d\n", sbrk(0));
   }
-  uint finish_clk = getclk();
-  void* finish_heap_top = sbrk(0);
-  printf("finishing test: %s\n", filename);
-  printf("heap used : %d bytes\n", finish_heap_top - begin_heap_top);
-  printf("time : %l\n", finish_clk - begin_clk);
+  out->ticks += getclk() - begin_clk;
+  out->live = max_total_size;
+  out->heap = peak_heap_top - begin_heap_top;
+  out->final = heap_top - begin_heap_top;
+  out->sbrk_calls = sbrk_calls;
+
+  write_samples(t, samples, num_samples);
+  if (eng->stats && !all_engines && !trim) eng->stats();
+}
+
+/*
+ * do one run of t in a fresh child, so that every run, and every engine,
+ * starts from the same untouched heap. returns 0 if the child failed.
+ */
+int run_child(struct trace* t, int checked, int sample, int trim, struct run* out) {
+  int fds[2];
+  if (pipe(fds) < 0) sys_err("pipe");
+  int pid = fork();
+  if (pid < 0) sys_err("fork");
+  if (pid == 0) {
+    close(fds[0]);
+    if (checked) {
+      check_run(t, sample, trim, out);
+    } else {
+      replay(t, out);
+    }
+    write(fds[1], out, sizeof(*out));
+    exit(0);
+  }
+  close(fds[1]);
+  int n = read(fds[0], out, sizeof(*out));
+  close(fds[0]);
+  wait(0);
+  return n == sizeof(*out);
+}
+
+// integer square root, by Newton's method
+uint64 isqrt(uint64 x) {
+  uint64 r = x, y = (x + 1) / 2;
+  while (y < r) {
+    r = y;
+    y = (r + x / r) / 2;
+  }
+  return r;
+}
+
+void run_test(struct trace* t, struct result* res) {
+  struct run check, run;
+  uint times[MAX_RUNS];
+  res->ok = -1;
+  if (t->memalign && !eng->memalign) return;
+  res->ok = 0;
+  if (!run_child(t, 1, 1, 0, &check)) return;
+  // mm_trim is checked on a run of its own, as it changes the heap numbers
+  if (eng->trim && !run_child(t, 1, 0, 1, &run)) return;
+  for (int r = 0; r < runs; ++r) {
+    if (alloc_only) {
+      // the trace checked out, now run it again on a fresh heap, unchecked
+      if (!run_child(t, 0, 0, 0, &run)) return;
+    } else if (r == 0) {
+      run = check;
+    } else if (!run_child(t, 1, 0, 0, &run)) {
+      return;
+    }
+    times[r] = run.ticks;
+  }
+
+  // insertion sort, there are only a few runs
+  uint64 sum = 0, var = 0;
+  for (int i = 0; i < runs; ++i) {
+    uint x = times[i];
+    int j = i;
+    for (; j > 0 && times[j - 1] > x; --j) times[j] = times[j - 1];
+    times[j] = x;
+    sum += x;
+  }
+  for (int i = 0; i < runs; ++i) {
+    long d = (long)times[i] - (long)(sum / runs);
+    var += d * d;
+  }
+  res->ok = 1;
+  res->ops = t->num_ops;
+  res->heap = check.heap;
+  res->ticks = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+  res->util = (uint64)check.live * 1000 / (check.heap ? check.heap : 1);
+  if (all_engines) return;
+
+  uint thru = (uint64)t->num_ops * 1000 / (res->ticks ? res->ticks : 1);
+  printf("finishing test: %s\n", t->name);
+  printf("heap used : %d bytes\n", check.final);
+  printf("peak heap : %d bytes\n", check.heap);
+  printf("utilization : %d.%d%%\n", res->util / 10, res->util % 10);
+  printf("time : %l\n", res->ticks);
+  if (runs > 1) {
+    printf("time min : %l, stddev : %l (%d runs)\n", times[0], isqrt(var / runs), runs);
+  }
+  printf("throughput : %d.%d%d%d ops/tick\n", thru / 1000, thru / 100 % 10, thru / 10 % 10, thru % 10);
+  printf("sbrk calls : %d\n", check.sbrk_calls);
+}
+
+// the score out of 1000 over the results that ran, or -1 if any failed
+int score(struct result* res, int n, int stride) {
+  uint64 util = 0, ops = 0, ticks = 0;
+  int ran = 0;
+  for (int i = 0; i < n; ++i, res += stride) {
+    if (res->ok == 0) return -1;
+    if (res->ok < 0) continue;
+    util += res->util;
+    ops += res->ops;
+    ticks += res->ticks;
+    ran++;
+  }
+  if (ran == 0) return -1;
+  util /= ran;
+  uint thru = ops * 1000 / (ticks ? ticks : 1);
+  if (thru > THRU_REF) thru = THRU_REF;
+  return (UTIL_WEIGHT * util + (100 - UTIL_WEIGHT) * thru * 1000 / THRU_REF) / 100;
+}
+
+// a table cell: s, padded with blanks to width
+void cell(char* s, int width) {
+  printf("%s", s);
+  for (int n = strlen(s); n < width; ++n) printf(" ");
 }
 
+// x in decimal at the end of buf[16], in tenths with a point if tenths is set
+char* utoa(uint x, int tenths, char* buf) {
+  char* p = buf + 15;
+  *p = 0;
+  if (tenths) {
+    *--p = '0' + x % 10;
+    *--p = '.';
+    x /= 10;
+  }
+  do {
+    *--p = '0' + x % 10;
+  } while ((x /= 10) != 0);
+  return p;
+}
+
+#define NAME_WIDTH 20
+#define CELL_WIDTH 12
+
+// one row per trace and one column per engine, of the ticks or the heap
+void print_table(char* title, struct trace* traces, int num_traces, struct result* res, int heap) {
+  char buf[16];
+  printf("\n");
+  cell(title, NAME_WIDTH);
+  for (int e = 0; e < NUM_ENGINES; ++e) cell(engines[e].name, CELL_WIDTH);
+  printf("\n");
+  for (int i = 0; i < num_traces; ++i) {
+    cell(traces[i].name, NAME_WIDTH);
+    for (int e = 0; e < NUM_ENGINES; ++e) {
+      struct result* r = res + i * NUM_ENGINES + e;
+      if (r->ok == 1) {
+        cell(utoa(heap ? r->heap : r->ticks, 0, buf), CELL_WIDTH);
+      } else {
+        cell(r->ok == 0 ? "fail" : "-", CELL_WIDTH);
+      }
+    }
+    printf("\n");
+  }
+}
+
+// usage: ummalloc_test [-t] [-n runs] [-c csvfile] [-e engine | -a] [tracefile ...]
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    char* test[] = {"amptjp-bal.rep", "binary2-bal.rep", "binary-bal.rep", "cccp-bal.rep", "coalescing-bal.rep",
-                    "cp-decl-bal.rep", "expr-bal.rep", "random2-bal.rep", "random-bal.rep", "realloc2-bal.rep",
-                    "realloc-bal.rep", "short1-bal.rep", "short2-bal.rep"};
+  char* test[] = {"amptjp-bal.bin", "binary2-bal.bin", "binary-bal.bin", "cccp-bal.bin", "coalescing-bal.bin",
+                  "cp-decl-bal.bin", "expr-bal.bin", "random2-bal.bin", "random-bal.bin", "realloc2-bal.bin",
+                  "realloc-bal.bin", "short1-bal.bin", "short2-bal.bin", "batch-bal.bin", "nobatch-bal.bin", "align-bal.bin",
+                  "sized-bal.bin", "calloc-bal.bin", "gen-bal.bin"};
+  char** names = test;
+  int num_traces = 19;
 
-    for (int i = 0; i < 13; i++) {
-      run_test(test[i]);
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-t") == 0) {
+      alloc_only = 1;
+    } else if (strcmp(argv[i], "-a") == 0) {
+      all_engines = 1;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+      if (runs < 1 || runs > MAX_RUNS) sys_err("runs out of range");
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      csv_fd = open(argv[++i], O_CREATE | O_WRONLY | O_TRUNC);
+      if (csv_fd == -1) sys_err("open csv fail");
+      fprintf(csv_fd, "engine,trace,op,heap,live\n");
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      for (eng = engines; eng < engines + NUM_ENGINES && strcmp(eng->name, argv[i + 1]) != 0; ++eng)
+        ;
+      if (eng == engines + NUM_ENGINES) sys_err("unknown engine");
+      ++i;
+    } else {
+      sys_err("usage: ummalloc_test [-t] [-n runs] [-c csvfile] [-e engine | -a] [tracefile ...]");
     }
-  } else {
-    run_test(argv[1]);
+  }
+  if (i < argc) {
+    names = argv + i;
+    num_traces = argc - i;
   }
 
+  struct trace* traces = malloc(num_traces * sizeof(struct trace));
+  struct result* res = malloc(num_traces * NUM_ENGINES * sizeof(struct result));
+  for (int j = 0; j < num_traces; j++) {
+    load_trace(names[j], traces + j);
+    for (int e = 0; e < NUM_ENGINES; ++e) {
+      if (!all_engines && engines + e != eng) continue;
+      struct engine* saved = eng;
+      eng = engines + e;
+      run_test(traces + j, res + j * NUM_ENGINES + e);
+      eng = saved;
+      if (!all_engines && res[j * NUM_ENGINES + e].ok != 1) {
+        printf("%s: %s %s\n", eng->name, traces[j].name, res[j * NUM_ENGINES + e].ok ? "needs mm_memalign" : "failed");
+        exit(3);
+      }
+    }
+    free(traces[j].ops);
+    if (traces[j].bin) free(traces[j].recs);
+  }
+  if (csv_fd >= 0) close(csv_fd);
+
+  if (all_engines) {
+    char buf[16];
+    print_table("time", traces, num_traces, res, 0);
+    print_table("heap", traces, num_traces, res, 1);
+    cell("score", NAME_WIDTH);
+    for (int e = 0; e < NUM_ENGINES; ++e) {
+      int s = score(res + e, num_traces, NUM_ENGINES);
+      cell(s < 0 ? "-" : utoa(s, 1, buf), CELL_WIDTH);
+    }
+    printf("\n");
+    exit(0);
+  }
+
+  int e = eng - engines;
+  uint64 util = 0, ops = 0, ticks = 0;
+  for (int j = 0; j < num_traces; j++) {
+    util += res[j * NUM_ENGINES + e].util;
+    ops += res[j * NUM_ENGINES + e].ops;
+    ticks += res[j * NUM_ENGINES + e].ticks;
+  }
+  util /= num_traces;
+  uint thru = ops * 1000 / (ticks ? ticks : 1);
+  uint s = score(res + e, num_traces, NUM_ENGINES);
+  printf("total : %d traces, utilization %d.%d%%, throughput %d.%d%d%d ops/tick\n", num_traces, util / 10, util % 10,
+         thru / 1000, thru / 100 % 10, thru / 10 % 10, thru % 10);
+  printf("score : %d.%d / 100\n", s / 10, s % 10);
+
   exit(0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,360 @@
+#include "kernel/types.h"
+#include <stddef.h>
+#include "user/user.h"
+#include "ummalloc.h"
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+//#define DEBUG
+//
+/* rounds up to the nearest multiple of ALIGNMENT */
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+
+#define SIZE_T_SIZE (ALIGN(sizeof(uint)))
+
+/*
+ * two-level segregated fit (TLSF), after M. Masmano et al.,
+ * "TLSF: a New Dynamic Memory Allocator for Real-Time Systems", ECRTS 2004
+ *
+ * free blocks are kept in FL_COUNT x SL_COUNT lists: the first level splits
+ * sizes by powers of two, the second level splits every power-of-two range
+ * into SL_COUNT equal parts. one bitmap word tells which first-level ranges
+ * have any free block, and one word per first level tells which of its
+ * second-level lists are non-empty, so malloc and free never walk a list:
+ * every operation is O(1).
+ */
+
+static char *heap_listp;
+
+#define WSIZE 4 /* Word and header/footer size (bytes) */
+#define DSIZE 8 /* Double word size (bytes) */
+#define CHUNKSIZE (1<<12) /* Extend heap by this amount (bytes) */
+
+#define SL_LOG2 4 /* log2 of the number of second-level lists */
+#define SL_COUNT (1 << SL_LOG2)
+#define FL_SHIFT (SL_LOG2 + 3) /* sizes below 1 << FL_SHIFT share first level 0 */
+#define SMALL_BLOCK (1 << FL_SHIFT)
+#define FL_COUNT (32 - FL_SHIFT + 1)
+
+/* @structure of the block
+ *
+ * 1. a 4-byte header with the size of the block and whether it is allocated
+ * 2. two 4-byte prev/next free-node addresses while the block is free
+ * 3. the payload, padded to a multiple of 8
+ * 4. a 4-byte footer, a copy of the header, on every block, free or
+ *    allocated: coalesce reads the alloc bit of the previous block there
+ *
+ * - bp is pointed at the beginning of #2
+ * - a block takes at least 16 bytes, so a free one has room for #2 and #4
+ * - a free block is on the list blocks[fl][sl] that mapping picks for its
+ *   size, and fl_bitmap and sl_bitmap[fl] have a bit set for every
+ *   non-empty list
+ */
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define PACK(size, alloc) ((size) | (alloc))
+#define GET(p) (*(uint *)(p))
+#define PUT(p, val) (*(uint *)(p) = (val))
+#define GET_SIZE(p) (GET(p) & ~0x7)
+#define GET_ALLOC(p) (GET(p) & 0x1)
+#define HDRP(bp) ((char *)(bp) - WSIZE)
+#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+#define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
+/* free list storage */
+#define PREV_FREE(bp) ((char *)(bp))
+#define NEXT_FREE(bp) ((char *)(bp) + WSIZE)
+#define NODE(p) ((char *) (uint64)GET(p))
+
+static uint fl_bitmap;
+static uint sl_bitmap[FL_COUNT];
+static char *blocks[FL_COUNT][SL_COUNT];
+
+/* floor(log2(v)) for v < 256, -1 for v == 0 */
+#define LT(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+static const char log_table[256] = {
+  -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+  LT(4), LT(5), LT(5), LT(6), LT(6), LT(6), LT(6),
+  LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7), LT(7)
+};
+
+/* index of the lowest set bit, by de Bruijn multiplication */
+static const char debruijn_table[32] = {
+  0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+  31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+};
+#define LOWEST_BIT(x) (debruijn_table[(((x) & -(x)) * 0x077CB531u) >> 27])
+
+int mm_init(void);
+void *mm_malloc(uint size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, uint size);
+static int fls(uint v);
+static void mapping(size_t size, int *fl, int *sl);
+static char *find_suitable(size_t asize);
+static void remove_block(char *bp);
+static void insert_block(char *bp);
+static void *split(char *bp, size_t asize);
+static void *coalesce(char *bp);
+static void *extend_heap(size_t size);
+static size_t align(size_t size);
+
+/*
+ * mm_init - initialize the malloc package.
+ */
+int mm_init(void) {
+  fl_bitmap = 0;
+  for (int i = 0; i < FL_COUNT; i++) {
+    sl_bitmap[i] = 0;
+    for (int j = 0; j < SL_COUNT; j++) {
+      blocks[i][j] = 0;
+    }
+  }
+
+  if ((heap_listp = sbrk(4 * WSIZE)) == (void *) -1)
+    return -1;
+
+  PUT(heap_listp, 0); /* Alignment padding */
+  PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
+  PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+  PUT(heap_listp + (3 * WSIZE), PACK(0, 1)); /* Epilogue header */
+  heap_listp += (2 * WSIZE);
+
+  if (extend_heap(CHUNKSIZE) == 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * mm_malloc - take the head of the first non-empty list whose every block
+ *     is large enough, and split off the tail.
+ */
+void *mm_malloc(uint size) {
+  size_t asize = align(size);
+  char *bp;
+
+  if (size == 0)
+    return 0;
+
+  if ((bp = find_suitable(asize)) != 0) {
+    remove_block(bp);
+  } else {
+    if ((bp = extend_heap(asize)) == 0)
+      return 0;
+    remove_block(bp);
+  }
+
+  return split(bp, asize);
+}
+
+/*
+ * mm_free - merge with free neighbours and push onto the matching list.
+ */
+void mm_free(void *ptr) {
+  size_t size = GET_SIZE(HDRP(ptr));
+
+  PUT(HDRP(ptr), PACK(size, 0));
+  PUT(FTRP(ptr), PACK(size, 0));
+  insert_block(coalesce(ptr));
+}
+
+/*
+ * mm_realloc - shrink in place, grow into a free successor when it is big
+ *     enough, otherwise fall back to malloc + copy + free.
+ */
+void *mm_realloc(void *ptr, uint size) {
+  void *newptr;
+
+  if (ptr == 0) {
+    return mm_malloc(size);
+  } else if (size == 0) {
+    mm_free(ptr);
+    return 0;
+  }
+
+  size_t origin_size = GET_SIZE(HDRP(ptr));
+  size_t asize = align(size);
+
+  if (asize <= origin_size) {
+    return split(ptr, asize);
+  }
+
+  char *next = NEXT_BLKP(ptr);
+  if (!GET_ALLOC(HDRP(next)) && origin_size + GET_SIZE(HDRP(next)) >= asize) {
+    remove_block(next);
+    origin_size += GET_SIZE(HDRP(next));
+    PUT(HDRP(ptr), PACK(origin_size, 1));
+    PUT(FTRP(ptr), PACK(origin_size, 1));
+    return split(ptr, asize);
+  }
+
+  if ((newptr = mm_malloc(size)) == 0)
+    return 0;
+  memcpy(newptr, ptr, origin_size - DSIZE);
+  mm_free(ptr);
+  return newptr;
+}
+
+/* floor(log2(v)) for v > 0, in four table steps */
+static int fls(uint v) {
+  if (v >> 16) {
+    return (v >> 24) ? 24 + log_table[v >> 24] : 16 + log_table[v >> 16];
+  }
+  return (v >> 8) ? 8 + log_table[v >> 8] : log_table[v];
+}
+
+/* first- and second-level list of a block of the given size */
+static void mapping(size_t size, int *fl, int *sl) {
+  if (size < SMALL_BLOCK) {
+    *fl = 0;
+    *sl = size / (SMALL_BLOCK / SL_COUNT);
+  } else {
+    int t = fls(size);
+    *fl = t - FL_SHIFT + 1;
+    *sl = (size >> (t - SL_LOG2)) ^ SL_COUNT;
+  }
+}
+
+/*
+ * @brief find a free block of at least asize bytes.
+ * the request is rounded up to the next second-level boundary first, so
+ * any block in the list it maps to (or a later one) is large enough and
+ * only the list heads are ever looked at.
+ */
+static char *find_suitable(size_t asize) {
+  int fl, sl;
+
+  if (asize >= SMALL_BLOCK) {
+    asize += (1 << (fls(asize) - SL_LOG2)) - 1;
+  }
+  mapping(asize, &fl, &sl);
+  if (fl >= FL_COUNT)
+    return 0;
+
+  uint sl_map = sl_bitmap[fl] & (~0u << sl);
+  if (sl_map == 0) {
+    uint fl_map = (fl + 1 < FL_COUNT) ? fl_bitmap & (~0u << (fl + 1)) : 0;
+    if (fl_map == 0)
+      return 0;
+    fl = LOWEST_BIT(fl_map);
+    sl_map = sl_bitmap[fl];
+  }
+  sl = LOWEST_BIT(sl_map);
+
+  return blocks[fl][sl];
+}
+
+static void remove_block(char *bp) {
+  int fl, sl;
+  char *prev = NODE(PREV_FREE(bp));
+  char *next = NODE(NEXT_FREE(bp));
+
+  mapping(GET_SIZE(HDRP(bp)), &fl, &sl);
+  if (next != 0) {
+    PUT(PREV_FREE(next), (uint64) prev);
+  }
+  if (prev != 0) {
+    PUT(NEXT_FREE(prev), (uint64) next);
+  } else {
+    blocks[fl][sl] = next;
+    if (next == 0) {
+      sl_bitmap[fl] &= ~(1u << sl);
+      if (sl_bitmap[fl] == 0) {
+        fl_bitmap &= ~(1u << fl);
+      }
+    }
+  }
+}
+
+static void insert_block(char *bp) {
+  int fl, sl;
+  char *head;
+
+  mapping(GET_SIZE(HDRP(bp)), &fl, &sl);
+  head = blocks[fl][sl];
+  PUT(PREV_FREE(bp), 0);
+  PUT(NEXT_FREE(bp), (uint64) head);
+  if (head != 0) {
+    PUT(PREV_FREE(head), (uint64) bp);
+  }
+  blocks[fl][sl] = bp;
+  sl_bitmap[fl] |= 1u << sl;
+  fl_bitmap |= 1u << fl;
+}
+
+/*
+ * @brief mark the first asize bytes of bp allocated and give the rest, if
+ * it can hold a block, back to the lists.
+ * bp must not be on any list.
+ */
+static void *split(char *bp, size_t asize) {
+  size_t csize = GET_SIZE(HDRP(bp));
+
+  if ((csize - asize) >= (2 * DSIZE)) {
+    PUT(HDRP(bp), PACK(asize, 1));
+    PUT(FTRP(bp), PACK(asize, 1));
+    char *rest = NEXT_BLKP(bp);
+    PUT(HDRP(rest), PACK(csize - asize, 0));
+    PUT(FTRP(rest), PACK(csize - asize, 0));
+    insert_block(coalesce(rest));
+  } else {
+    PUT(HDRP(bp), PACK(csize, 1));
+    PUT(FTRP(bp), PACK(csize, 1));
+  }
+  return bp;
+}
+
+/*
+ * @brief merge the free block bp with its free neighbours, taking them off
+ * their lists. the result is not on any list.
+ */
+static void *coalesce(char *bp) {
+  size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (!next_alloc) {
+    remove_block(NEXT_BLKP(bp));
+    size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+  }
+  if (!prev_alloc) {
+    remove_block(PREV_BLKP(bp));
+    size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+    PUT(FTRP(bp), PACK(size, 0));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+    bp = PREV_BLKP(bp);
+  }
+  return bp;
+}
+
+/*
+ * @brief grow the heap by size bytes and return the new free block, merged
+ * with a free block at the old end of the heap. the result is on a list.
+ */
+static void *extend_heap(size_t size) {
+  char *bp;
+
+  if ((long) (bp = sbrk(size)) == -1)
+    return 0;
+#ifdef DEBUG
+  printf("extend_heap: %p, %d\n", bp, size);
+#endif
+
+  PUT(HDRP(bp), PACK(size, 0)); /* Free block header */
+  PUT(FTRP(bp), PACK(size, 0)); /* Free block footer */
+  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+
+  bp = coalesce(bp);
+  insert_block(bp);
+  return bp;
+}
+
+static size_t align(size_t size) {
+  if (size <= DSIZE) {
+    return 2 * DSIZE;
+  } else {
+    return DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+  }
+}
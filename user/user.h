@@ -51,3 +51,14 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+#ifdef MTRACE
+// ulib.c: umalloc.c's malloc/free trace is written out before a process
+// exits or execs, and a forked child starts one of its own
+int mtrace_fork(void);
+int mtrace_exit(int) __attribute__((noreturn));
+int mtrace_exec(const char*, char**);
+#define fork mtrace_fork
+#define exit mtrace_exit
+#define exec mtrace_exec
+#endif